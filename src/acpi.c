@@ -0,0 +1,103 @@
+// acpi.c -- Locating ACPI tables
+
+#include "acpi.h"
+#include "paging.h"
+
+// Root System Description Pointer, ищется в памяти BIOS
+typedef struct acpi_rsdp
+{
+	char signature[8];		// "RSD PTR "
+	u8int checksum;			// Для первых 20 байт
+	char oem_id[6];
+	u8int revision;
+	u32int rsdt_address;
+} __attribute__((packed)) acpi_rsdp_t;
+
+#define RSDT_MAX_ENTRIES 64
+
+// Физический адрес RSDT, 0 - еще не искали, -1 - ACPI нет
+static u32int rsdt_phys = 0;
+
+static u8int checksum(const void *p, u32int len)
+{
+	const u8int *b = (const u8int*)p;
+	u8int sum = 0;
+	while (len--)
+		sum += *b++;
+	return sum;
+}
+
+static acpi_rsdp_t *scan_rsdp(u32int start, u32int end)
+{
+	// Структура лежит на границе 16 байт. Первый мегабайт
+	// физической памяти отображен ядром целиком
+	for (start &= ~0xF; start < end; start += 16)
+	{
+		acpi_rsdp_t *rsdp = (acpi_rsdp_t*)PHYS_TO_VIRT(start);
+		if (!memcmp(rsdp->signature, "RSD PTR ", 8) && !checksum(rsdp, 20))
+			return rsdp;
+	}
+	return 0;
+}
+
+static u32int find_rsdt()
+{
+	// Первый килобайт EBDA, затем область BIOS 0xE0000-0xFFFFF
+	u32int ebda = *(u16int*)PHYS_TO_VIRT(0x40E) << 4;
+	acpi_rsdp_t *rsdp = 0;
+
+	if (ebda)
+		rsdp = scan_rsdp(ebda, ebda + 0x400);
+	if (!rsdp)
+		rsdp = scan_rsdp(0xE0000, 0x100000);
+	return rsdp ? rsdp->rsdt_address : (u32int)-1;
+}
+
+// Отображает len байт по физическому адресу phys в окно ACPI
+static void *acpi_map(u32int phys, u32int len)
+{
+	u32int pages = ((phys & 0xFFF) + len + 0xFFF) / 0x1000;
+	u32int i;
+
+	if (pages > FIXMAP_ACPI_PAGES)
+		return 0;
+	for (i = 0; i < pages; ++i)
+		map_page(kernel_directory, FIXMAP_ADDR(FIXMAP_ACPI + i),
+			(phys & 0xFFFFF000) + i*0x1000, PAGE_GLOBAL);
+	return (void*)(FIXMAP_ADDR(FIXMAP_ACPI) + (phys & 0xFFF));
+}
+
+// Отображает таблицу целиком и проверяет ее контрольную сумму
+static acpi_header_t *map_table(u32int phys)
+{
+	acpi_header_t *h = (acpi_header_t*)acpi_map(phys, sizeof(acpi_header_t));
+	if (!h || !(h = (acpi_header_t*)acpi_map(phys, h->length)))
+		return 0;
+	return checksum(h, h->length) ? 0 : h;
+}
+
+acpi_header_t *acpi_find_table(const char *sig)
+{
+	u32int entries[RSDT_MAX_ENTRIES];
+	acpi_header_t *h;
+	u32int i, n;
+
+	if (!rsdt_phys)
+		rsdt_phys = find_rsdt();
+	if (rsdt_phys == (u32int)-1 || !(h = map_table(rsdt_phys)))
+		return 0;
+
+	// Окно одно, поэтому адреса таблиц сначала копируем
+	n = (h->length - sizeof(acpi_header_t)) / 4;
+	if (n > RSDT_MAX_ENTRIES)
+		n = RSDT_MAX_ENTRIES;
+	memcpy(entries, h + 1, n*4);
+
+	for (i = 0; i < n; ++i)
+	{
+		h = (acpi_header_t*)acpi_map(entries[i], sizeof(acpi_header_t));
+		if (h && !memcmp(h->signature, sig, 4))
+			return map_table(entries[i]);
+	}
+	return 0;
+}
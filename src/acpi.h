@@ -0,0 +1,30 @@
+// acpi.h -- Locating ACPI tables
+
+#ifndef ACPI_H_
+#define ACPI_H_
+
+#include "common.h"
+
+// Общий заголовок всех таблиц ACPI
+typedef struct acpi_header
+{
+	char signature[4];
+	u32int length;			// Длина всей таблицы вместе с заголовком
+	u8int revision;
+	u8int checksum;
+	char oem_id[6];
+	char oem_table_id[8];
+	u32int oem_revision;
+	u32int creator_id;
+	u32int creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+/**
+ * Ищет таблицу с подписью sig ("APIC", "FACP", ...) через RSDP и RSDT.
+ * Таблица отображается в окно FIXMAP_ACPI и доступна до следующего
+ * вызова. Возвращает 0, если ACPI нет, таблица не найдена, длиннее
+ * окна или не сходится ее контрольная сумма.
+ */
+extern acpi_header_t *acpi_find_table(const char *sig);
+
+#endif
@@ -0,0 +1,266 @@
+// apic.c -- Local APIC and IOAPIC interrupt controllers
+
+#include "apic.h"
+#include "acpi.h"
+#include "isr.h"
+#include "clock.h"
+
+// Записи таблицы MADT
+#define MADT_LAPIC			0
+#define MADT_IOAPIC			1
+#define MADT_OVERRIDE		2
+#define MADT_LAPIC_ADDR		5
+
+typedef struct madt_entry
+{
+	u8int type;
+	u8int length;
+} __attribute__((packed)) madt_entry_t;
+
+typedef struct madt_lapic
+{
+	madt_entry_t h;
+	u8int cpu_id;
+	u8int apic_id;
+	u32int flags;			// Бит 0 - процессор можно использовать
+} __attribute__((packed)) madt_lapic_t;
+
+typedef struct madt_ioapic
+{
+	madt_entry_t h;
+	u8int id;
+	u8int reserved;
+	u32int address;
+	u32int gsi_base;		// Первое глобальное прерывание его входов
+} __attribute__((packed)) madt_ioapic_t;
+
+typedef struct madt_override
+{
+	madt_entry_t h;
+	u8int bus;				// Всегда 0 - ISA
+	u8int source;			// Номер IRQ
+	u32int gsi;				// Вход IOAPIC, к которому он подключен
+	u16int flags;
+} __attribute__((packed)) madt_override_t;
+
+typedef struct madt_lapic_addr
+{
+	madt_entry_t h;
+	u16int reserved;
+	u32int address_low;
+	u32int address_high;
+} __attribute__((packed)) madt_lapic_addr_t;
+
+// Флаги переопределения (как в таблицах MP)
+#define INTI_POLARITY_LOW	0x3
+#define INTI_TRIGGER_LEVEL	0xC
+
+// Регистры IOAPIC доступны косвенно: номер в IOREGSEL, значение в IOWIN
+#define IOAPIC_IOREGSEL		0x00
+#define IOAPIC_IOWIN		0x10
+#define IOAPIC_VERSION		0x01
+#define IOAPIC_REDIR(n)		(0x10 + 2*(n))
+
+#define REDIR_MASKED		0x10000
+#define REDIR_LEVEL			0x08000
+#define REDIR_ACTIVE_LOW	0x02000
+
+#define LAPIC_CALIBRATE_US	10000
+
+#define IA32_APIC_BASE		0x1B
+#define APIC_BASE_ENABLE	0x800
+
+typedef struct ioapic
+{
+	u32int base;			// Виртуальный адрес регистров
+	u32int gsi_base;
+	u32int npins;
+} ioapic_t;
+
+int apic_active = 0;
+u32int apic_ncpus = 0;
+u8int apic_cpu_ids[APIC_MAX_CPUS];
+
+static u32int lapic_phys_base = 0;
+static ioapic_t ioapics[APIC_MAX_IOAPICS];
+static u32int nioapics = 0;
+
+// Для каждого IRQ 0-15 - вход IOAPIC и флаги подключения
+static u32int irq_gsi[16];
+static u16int irq_flags[16];
+
+static u32int ioapic_read(ioapic_t *io, u32int reg)
+{
+	*(volatile u32int*)(io->base + IOAPIC_IOREGSEL) = reg;
+	return *(volatile u32int*)(io->base + IOAPIC_IOWIN);
+}
+
+static void ioapic_write(ioapic_t *io, u32int reg, u32int value)
+{
+	*(volatile u32int*)(io->base + IOAPIC_IOREGSEL) = reg;
+	*(volatile u32int*)(io->base + IOAPIC_IOWIN) = value;
+}
+
+// Разбирает MADT. Возвращает физический адрес local APIC или 0
+static u32int parse_madt()
+{
+	acpi_header_t *madt = acpi_find_table("APIC");
+	u32int lapic_phys, p, end, i;
+
+	if (!madt)
+		return 0;
+	lapic_phys = *(u32int*)((u32int)madt + sizeof(acpi_header_t));
+
+	for (i = 0; i < 16; ++i)
+	{
+		irq_gsi[i] = i;
+		irq_flags[i] = 0;
+	}
+
+	// За адресом local APIC и флагами идут записи переменной длины
+	p = (u32int)madt + sizeof(acpi_header_t) + 8;
+	end = (u32int)madt + madt->length;
+	for (; p + sizeof(madt_entry_t) <= end; p += ((madt_entry_t*)p)->length)
+	{
+		madt_entry_t *e = (madt_entry_t*)p;
+		if (e->length < sizeof(madt_entry_t))
+			break;
+
+		if (e->type == MADT_LAPIC)
+		{
+			madt_lapic_t *l = (madt_lapic_t*)e;
+			if ((l->flags & 0x1) && apic_ncpus < APIC_MAX_CPUS)
+				apic_cpu_ids[apic_ncpus++] = l->apic_id;
+		}
+		else if (e->type == MADT_IOAPIC && nioapics < APIC_MAX_IOAPICS)
+		{
+			madt_ioapic_t *io = (madt_ioapic_t*)e;
+			// Регистры отображаем сразу: окно ACPI при этом не трогаем
+			map_page(kernel_directory, FIXMAP_ADDR(FIXMAP_IOAPIC + nioapics), io->address,
+				PAGE_GLOBAL | PAGE_PCD | PAGE_PWT | PAGE_RW);
+			ioapics[nioapics].base = FIXMAP_ADDR(FIXMAP_IOAPIC + nioapics) + (io->address & 0xFFF);
+			ioapics[nioapics].gsi_base = io->gsi_base;
+			nioapics++;
+		}
+		else if (e->type == MADT_OVERRIDE)
+		{
+			madt_override_t *o = (madt_override_t*)e;
+			if (o->bus == 0 && o->source < 16)
+			{
+				irq_gsi[o->source] = o->gsi;
+				irq_flags[o->source] = o->flags;
+			}
+		}
+		else if (e->type == MADT_LAPIC_ADDR)
+		{
+			madt_lapic_addr_t *a = (madt_lapic_addr_t*)e;
+			if (!a->address_high)
+				lapic_phys = a->address_low;
+		}
+	}
+	return lapic_phys;
+}
+
+void lapic_init_cpu()
+{
+	// Регистры local APIC у всех процессоров по одному адресу
+	wrmsr(IA32_APIC_BASE, (rdmsr(IA32_APIC_BASE) & 0xFFFFF000) | lapic_phys_base | APIC_BASE_ENABLE);
+	lapic_write(LAPIC_TPR, 0);
+	lapic_write(LAPIC_SVR, 0x100 | IRQ_SPURIOUS);
+}
+
+void lapic_timer_start(u32int hz)
+{
+	u32int count;
+
+	// Сколько отсчетов при делителе 16 проходит за LAPIC_CALIBRATE_US
+	lapic_write(LAPIC_TIMER_DIV, 0x3);
+	lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+	lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+	udelay(LAPIC_CALIBRATE_US);
+	count = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_COUNT);
+
+	lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_PERIODIC | IRQ_LAPIC_TIMER);
+	lapic_write(LAPIC_TIMER_INIT, count * (1000000 / LAPIC_CALIBRATE_US) / hz);
+}
+
+void apic_send_ipi(u32int apic_id, u32int icr)
+{
+	lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+	lapic_write(LAPIC_ICR_LOW, icr);
+	while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING)
+		cpu_relax();
+}
+
+static ioapic_t *ioapic_for_gsi(u32int gsi)
+{
+	u32int i;
+	for (i = 0; i < nioapics; ++i)
+		if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].npins)
+			return &ioapics[i];
+	return 0;
+}
+
+int init_apic()
+{
+	u32int eax, ebx, ecx, edx, flags, lapic_phys, i, j, bsp;
+
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+	if (!(edx & (0x1 << 9)))
+		return 0;	// Local APIC нет
+	if (!(lapic_phys = parse_madt()) || !nioapics)
+		return 0;
+
+	map_page(kernel_directory, LAPIC_BASE, lapic_phys,
+		PAGE_GLOBAL | PAGE_PCD | PAGE_PWT | PAGE_RW);
+	lapic_phys_base = lapic_phys;
+
+	__asm__ volatile ("pushf; pop %0; cli" : "=r"(flags));
+
+	// 8259 остается настроенным (init_idt) и только маскируется
+	outb(0x21, 0xFF);
+	outb(0xA1, 0xFF);
+
+	lapic_init_cpu();
+	bsp = lapic_id();
+
+	// Ядро запущено на BSP - ставим его первым в списке процессоров
+	for (i = 0; i < apic_ncpus; ++i)
+	{
+		if (apic_cpu_ids[i] == bsp)
+		{
+			apic_cpu_ids[i] = apic_cpu_ids[0];
+			apic_cpu_ids[0] = bsp;
+		}
+	}
+
+	// Все входы сначала маскируем
+	for (i = 0; i < nioapics; ++i)
+	{
+		ioapics[i].npins = ((ioapic_read(&ioapics[i], IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+		for (j = 0; j < ioapics[i].npins; ++j)
+			ioapic_write(&ioapics[i], IOAPIC_REDIR(j), REDIR_MASKED);
+	}
+
+	// IRQ 0-15 получают те же векторы, что и при 8259. IRQ2 - каскад
+	// 8259, устройств на нем нет (а IRQ0 обычно переопределен на вход 2)
+	for (i = 0; i < 16; ++i)
+	{
+		ioapic_t *io = ioapic_for_gsi(irq_gsi[i]);
+		u32int low = IRQ0 + i;
+		if (i == 2 || !io)
+			continue;
+		// По умолчанию ISA: фронт, активный высокий уровень
+		if ((irq_flags[i] & INTI_POLARITY_LOW) == INTI_POLARITY_LOW)
+			low |= REDIR_ACTIVE_LOW;
+		if ((irq_flags[i] & INTI_TRIGGER_LEVEL) == INTI_TRIGGER_LEVEL)
+			low |= REDIR_LEVEL;
+		j = irq_gsi[i] - io->gsi_base;
+		ioapic_write(io, IOAPIC_REDIR(j) + 1, bsp << 24);
+		ioapic_write(io, IOAPIC_REDIR(j), low);
+	}
+
+	apic_active = 1;
+	__asm__ volatile ("push %0; popf" : : "r"(flags) : "memory", "cc");
+	return 1;
+}
@@ -0,0 +1,99 @@
+// apic.h -- Local APIC and IOAPIC interrupt controllers
+
+#ifndef APIC_H_
+#define APIC_H_
+
+#include "common.h"
+#include "paging.h"
+
+#define APIC_MAX_CPUS		16
+#define APIC_MAX_IOAPICS	4
+
+// Регистры local APIC (смещения от начала его страницы)
+#define LAPIC_ID			0x020
+#define LAPIC_VERSION		0x030
+#define LAPIC_TPR			0x080	// Приоритет задачи
+#define LAPIC_EOI			0x0B0
+#define LAPIC_SVR			0x0F0	// Вектор ложного прерывания и бит включения
+#define LAPIC_ICR_LOW		0x300	// Отправка межпроцессорных прерываний
+#define LAPIC_ICR_HIGH		0x310
+#define LAPIC_LVT_TIMER		0x320
+#define LAPIC_LVT_LINT0		0x350
+#define LAPIC_LVT_LINT1		0x360
+#define LAPIC_TIMER_INIT	0x380
+#define LAPIC_TIMER_COUNT	0x390
+#define LAPIC_TIMER_DIV		0x3E0
+
+// Поля LAPIC_LVT_TIMER
+#define LVT_MASKED			0x10000
+#define LVT_TIMER_PERIODIC	0x20000
+
+// Поля LAPIC_ICR_LOW
+#define ICR_INIT			0x00500
+#define ICR_STARTUP			0x00600
+#define ICR_PENDING			0x01000	// Прерывание еще не доставлено
+#define ICR_ASSERT			0x04000
+#define ICR_LEVEL			0x08000
+
+#define LAPIC_BASE			FIXMAP_ADDR(FIXMAP_LAPIC)
+
+// Не ноль, если прерывания идут через IOAPIC и local APIC,
+// а 8259 замаскирован
+extern int apic_active;
+
+// Идентификаторы local APIC всех процессоров из таблицы MADT.
+// Первым идет процессор, на котором запущено ядро
+extern u32int apic_ncpus;
+extern u8int apic_cpu_ids[APIC_MAX_CPUS];
+
+/**
+ * Находит local APIC и IOAPIC через таблицу MADT, направляет
+ * IRQ 0-15 через IOAPIC на те же векторы IRQ0..IRQ15 и маскирует
+ * 8259. Вызывается после initialise_paging(). Если APIC нет,
+ * возвращает 0 и прерывания остаются на 8259.
+ */
+extern int init_apic();
+
+/**
+ * Включает local APIC текущего процессора. init_apic() делает это
+ * для BSP, каждый AP вызывает сам при запуске
+ */
+extern void lapic_init_cpu();
+
+/**
+ * Запускает периодический таймер local APIC текущего процессора
+ * с частотой hz на векторе IRQ_LAPIC_TIMER. Частота шины local APIC
+ * измеряется по TSC
+ */
+extern void lapic_timer_start(u32int hz);
+
+/**
+ * Посылает процессору с идентификатором apic_id межпроцессорное
+ * прерывание: icr - значение LAPIC_ICR_LOW (вектор и ICR_*).
+ * Ждет, пока local APIC примет его к доставке
+ */
+extern void apic_send_ipi(u32int apic_id, u32int icr);
+
+static inline u32int lapic_read(u32int reg)
+{
+	return *(volatile u32int*)(LAPIC_BASE + reg);
+}
+
+static inline void lapic_write(u32int reg, u32int value)
+{
+	*(volatile u32int*)(LAPIC_BASE + reg) = value;
+}
+
+// Идентификатор local APIC текущего процессора
+static inline u32int lapic_id()
+{
+	return lapic_read(LAPIC_ID) >> 24;
+}
+
+// Конец обработки прерывания: одна запись в регистр вместо outb в 8259
+static inline void apic_eoi()
+{
+	lapic_write(LAPIC_EOI, 0);
+}
+
+#endif
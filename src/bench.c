@@ -0,0 +1,616 @@
+// bench.c -- Microbenchmarks run at boot when the kernel is built
+//            with 'make BENCH=1'
+
+#include "bench.h"
+#include "monitor.h"
+#include "kprintf.h"
+#include "paging.h"
+#include "kheap.h"
+#include "softirq.h"
+#include "timer.h"
+#include "task.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "wait.h"
+#include "clock.h"
+
+#define BENCH_FRAMES 1024
+
+static void report(char *name, u64int cycles, u32int ops)
+{
+	kprintf("%s: %u cycles/op\n", name, (u32int)cycles / ops);
+}
+
+static void bench_frames_size(char *name, u32int n)
+{
+	static u32int addrs[BENCH_FRAMES];
+	u64int t;
+	u32int i;
+
+	kprintf("frames %s\n", name);
+	init_frames(n);
+	for (i = 0; i < n; ++i)
+		frame_free(i*0x1000);
+
+	// Пустая память
+	t = rdtsc();
+	for (i = 0; i < BENCH_FRAMES; ++i)
+		addrs[i] = frame_alloc();
+	report("  alloc (empty)", rdtsc() - t, BENCH_FRAMES);
+
+	t = rdtsc();
+	for (i = 0; i < BENCH_FRAMES; ++i)
+		frame_free(addrs[i]);
+	report("  free", rdtsc() - t, BENCH_FRAMES);
+
+	// Заполняем всю память, кроме кадров в самом конце:
+	// худший случай для линейного поиска
+	while (nfree_frames > BENCH_FRAMES)
+		frame_alloc();
+	t = rdtsc();
+	for (i = 0; i < BENCH_FRAMES; ++i)
+		addrs[i] = frame_alloc();
+	report("  alloc (full)", rdtsc() - t, BENCH_FRAMES);
+
+	if (frame_alloc() != (u32int)-1)
+		kprintf("  out of memory not reported!\n");
+}
+
+void bench_frames()
+{
+	bench_frames_size("16MB", 0x1000000 / 0x1000);
+	bench_frames_size("512MB", 0x20000000 / 0x1000);
+	bench_frames_size("4GB", 0x100000);
+}
+
+#define BENCH_CLONE_BASE 0x40000000
+
+void bench_clone()
+{
+	static const u32int sizes[] = { 0, 64, 512, 2048 };
+	page_directory_t *dir = clone_directory(kernel_directory);
+	u32int touched = 0, i, n;
+
+	switch_page_directory(dir);
+	vmm_reserve(dir, BENCH_CLONE_BASE, 2048*0x1000, VMA_WRITE | VMA_USER);
+
+	for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i)
+	{
+		page_directory_t *copy;
+		u64int t;
+
+		// Доводим резидентный набор до sizes[i] страниц
+		for (n = sizes[i]; touched < n; ++touched)
+			*(u32int*)(BENCH_CLONE_BASE + touched*0x1000) = touched;
+
+		t = rdtsc();
+		copy = clone_directory(dir);
+		t = rdtsc() - t;
+
+		kprintf("clone with %u resident pages: %u cycles\n", n, (u32int)t);
+		free_directory(copy);
+	}
+
+	switch_page_directory(kernel_directory);
+	free_directory(dir);
+}
+
+#define BENCH_TLB_ALIAS 0x80000000
+#define BENCH_TLB_PAGES 1024
+
+// Reads one word from each of BENCH_TLB_PAGES pages at base in a
+// scattered order right after a CR3 reload, returns cycles per page
+static u32int touch_pages(u32int base)
+{
+	u32int i, p = 0, sum = 0;
+	u64int t;
+
+	__asm__ volatile ("mov %%cr3, %%eax; mov %%eax, %%cr3" : : : "eax", "memory");
+	t = rdtsc();
+	for (i = 0; i < BENCH_TLB_PAGES; ++i)
+	{
+		p = (p + 257) % BENCH_TLB_PAGES;
+		sum += *(volatile u32int*)(base + p*0x1000 + 0x10);
+	}
+	t = rdtsc() - t;
+	return (u32int)t / BENCH_TLB_PAGES;
+}
+
+void bench_tlb()
+{
+	u32int i;
+
+	// Второе отображение первых 4 МБ физической памяти, 4 кБ страницами
+	map_range(kernel_directory, BENCH_TLB_ALIAS, 0, BENCH_TLB_PAGES*0x1000, 0);
+
+	touch_pages(BENCH_TLB_ALIAS); // прогреваем кэш данных
+	report("tlb 4KB pages", touch_pages(BENCH_TLB_ALIAS), 1);
+	if ((paging_flags & (PAGING_PSE | PAGING_PGE)) == (PAGING_PSE | PAGING_PGE))
+		report("tlb 4MB global page", touch_pages(KERNEL_VIRTUAL_BASE), 1);
+	else
+		kprintf("tlb: no PSE/PGE, kernel uses 4KB pages\n");
+
+	for (i = 0; i < BENCH_TLB_PAGES; ++i)
+		unmap_page(kernel_directory, BENCH_TLB_ALIAS + i*0x1000);
+	// Иначе пустую таблицу унаследуют все пространства задач
+	free_user_table(kernel_directory, BENCH_TLB_ALIAS);
+}
+
+#define BENCH_MEM_MAX	0x100000
+#define BENCH_MEM_BYTES	0x400000	// Сколько байт обрабатываем на каждом размере
+
+// Prints bytes per cycle with two decimals
+static void report_rate(char *name, u32int size, u64int cycles, u32int bytes)
+{
+	u32int rate = bytes / ((u32int)cycles / 100 + 1);
+	kprintf("%s %u B: %u.%02u bytes/cycle\n", name, size, rate / 100, rate % 100);
+}
+
+void bench_mem()
+{
+	u8int *src = (u8int*)kmalloc_a(BENCH_MEM_MAX + 0x1000);
+	u8int *dst = (u8int*)kmalloc_a(BENCH_MEM_MAX + 0x1000);
+	u32int size, i, n;
+	u64int t;
+
+	memset(src, 0x5A, BENCH_MEM_MAX + 0x1000);
+	for (size = 8; size <= BENCH_MEM_MAX; size *= 8)
+	{
+		n = BENCH_MEM_BYTES / size;
+
+		t = rdtsc();
+		for (i = 0; i < n; ++i)
+			memcpy(dst, src, size);
+		report_rate("memcpy", size, rdtsc() - t, n*size);
+
+		// Невыровненные начало и конец
+		t = rdtsc();
+		for (i = 0; i < n; ++i)
+			memcpy(dst + 1, src + 3, size);
+		report_rate("memcpy unaligned", size, rdtsc() - t, n*size);
+
+		t = rdtsc();
+		for (i = 0; i < n; ++i)
+			memset(dst, 0, size);
+		report_rate("memset", size, rdtsc() - t, n*size);
+	}
+
+	kfree(dst);
+	kfree(src);
+}
+
+#define BENCH_CONSOLE_LINES 200
+
+// Per-line cost of console output: each character on its own
+// through monitor_put(), and whole lines through monitor_write()
+void bench_console()
+{
+	static char line[] = "The quick brown fox jumps over the lazy dog 0123456789\n";
+	u64int t1, t2;
+	u32int i;
+	char *c;
+
+	t1 = rdtsc();
+	for (i = 0; i < BENCH_CONSOLE_LINES; ++i)
+		for (c = line; *c; ++c)
+			monitor_put(*c);
+	t1 = rdtsc() - t1;
+
+	t2 = rdtsc();
+	for (i = 0; i < BENCH_CONSOLE_LINES; ++i)
+		monitor_write(line);
+	t2 = rdtsc() - t2;
+
+	report("console monitor_put", t1, BENCH_CONSOLE_LINES);
+	report("console monitor_write", t2, BENCH_CONSOLE_LINES);
+}
+
+// Задержка прерываний: PIT (IRQ0) в режиме 2 на 1 кГц служит зондом,
+// RTC (IRQ8) на 1024 Гц - источником медленной работы. Обработчик
+// IRQ0 читает оставшийся счет PIT: сколько тактов PIT прошло с
+// момента прерывания до входа в обработчик.
+#define BENCH_PIT_DIVISOR	1193	// 1193180 / 1193 = 1 кГц
+#define BENCH_PIT_PERIOD_NS	999848	// Период тика с этим делителем
+#define BENCH_IRQ_TICKS		1000
+#define BENCH_SLOW_CYCLES	200000
+
+static volatile u32int probe_ticks;
+static volatile u32int probe_max;
+
+static void probe_callback(registers_t *regs)
+{
+	u32int count;
+	outb(0x43, 0x00);	// Защелкнуть счетчик канала 0
+	count = inb(0x40);
+	count |= inb(0x40) << 8;
+	if (BENCH_PIT_DIVISOR - count > probe_max)
+		probe_max = BENCH_PIT_DIVISOR - count;
+	probe_ticks++;
+	// Обработчик таймера ядра отключен, но часы должны идти
+	clock_tick(BENCH_PIT_PERIOD_NS);
+}
+
+static void slow_work()
+{
+	u64int end = rdtsc() + BENCH_SLOW_CYCLES;
+	while (rdtsc() < end)
+		__asm__ volatile ("pause");
+}
+
+static void slow_softirq()
+{
+	slow_work();
+}
+
+static void rtc_ack()
+{
+	// Без чтения регистра C RTC больше не прерывает
+	outb(0x70, 0x0C);
+	inb(0x71);
+}
+
+static void rtc_inline(registers_t *regs)
+{
+	rtc_ack();
+	slow_work();
+}
+
+static void rtc_deferred(registers_t *regs)
+{
+	rtc_ack();
+	raise_softirq(SOFTIRQ_BENCH);
+}
+
+static void set_rtc_periodic(int on)
+{
+	u8int b;
+	outb(0x70, 0x8B);	// Регистр B, NMI запрещены
+	b = inb(0x71);
+	outb(0x70, 0x8B);
+	outb(0x71, on ? b | 0x40 : b & ~0x40);
+	rtc_ack();
+}
+
+// Максимальная задержка IRQ0 за BENCH_IRQ_TICKS тиков, в тактах PIT
+static u32int measure_latency(isr_t rtc_handler)
+{
+	register_interrupt_handler(IRQ8, rtc_handler);
+	probe_max = 0;
+	probe_ticks = 0;
+	while (probe_ticks < BENCH_IRQ_TICKS)
+		__asm__ volatile ("hlt");
+	return probe_max;
+}
+
+void bench_irq_latency()
+{
+	u32int before, after;
+	u8int rate;
+
+	register_softirq(SOFTIRQ_BENCH, &slow_softirq);
+	register_interrupt_handler(IRQ0, &probe_callback);
+	outb(0x43, 0x34);	// Канал 0, режим 2
+	outb(0x40, BENCH_PIT_DIVISOR & 0xFF);
+	outb(0x40, BENCH_PIT_DIVISOR >> 8);
+
+	outb(0x70, 0x8A);	// Регистр A: частота 1024 Гц
+	rate = inb(0x71);
+	outb(0x70, 0x8A);
+	outb(0x71, (rate & 0xF0) | 0x06);
+	set_rtc_periodic(1);
+
+	before = measure_latency(&rtc_inline);
+	after = measure_latency(&rtc_deferred);
+
+	set_rtc_periodic(0);
+	register_interrupt_handler(IRQ8, 0);
+	register_softirq(SOFTIRQ_BENCH, 0);
+	// Возвращаем PIT и обработчик IRQ0 таймеру ядра
+	init_timer(TIMER_HZ);
+
+	// Такт PIT - 838 нс
+	kprintf("irq0 worst latency, slow work in irq: %u us\n", before * 838 / 1000);
+	kprintf("irq0 worst latency, slow work in softirq: %u us\n", after * 838 / 1000);
+}
+
+#define BENCH_TIMERS		32768
+#define BENCH_TIMER_SHORT	64		// Тиков до срабатывания в тесте срабатывания
+
+static volatile u32int bench_fired;
+
+static void bench_timer_fn(void *arg)
+{
+	bench_fired++;
+}
+
+void bench_timers()
+{
+	ktimer_t *timers = (ktimer_t*)kmalloc(BENCH_TIMERS * sizeof(ktimer_t));
+	u32int i, seed = 1, expired, flags;
+	u64int t, cycles;
+
+	for (i = 0; i < BENCH_TIMERS; ++i)
+		timer_setup(&timers[i], &bench_timer_fn, 0);
+
+	// Сроки от тика до ~3 часов: таймеры попадают на все уровни
+	t = rdtsc();
+	for (i = 0; i < BENCH_TIMERS; ++i)
+	{
+		seed = seed*1103515245 + 12345;
+		timer_add(&timers[i], 1 + (seed >> 12) % 0x100000);
+	}
+	report("timer_add", rdtsc() - t, BENCH_TIMERS);
+
+	t = rdtsc();
+	for (i = 0; i < BENCH_TIMERS; ++i)
+		timer_cancel(&timers[i]);
+	report("timer_cancel", rdtsc() - t, BENCH_TIMERS);
+
+	// Срабатывание: время, проведенное колесом в softirq,
+	// на один сработавший таймер
+	bench_fired = 0;
+	__asm__ volatile ("pushf; pop %0; cli" : "=r"(flags));
+	expired = timer_expired;
+	cycles = timer_run_cycles;
+	for (i = 0; i < BENCH_TIMERS; ++i)
+		timer_add(&timers[i], 1 + i % BENCH_TIMER_SHORT);
+	__asm__ volatile ("push %0; popf" : : "r"(flags) : "memory", "cc");
+	while (bench_fired < BENCH_TIMERS)
+		__asm__ volatile ("hlt");
+	report("timer expire", timer_run_cycles - cycles, timer_expired - expired);
+
+	kfree(timers);
+}
+
+#define BENCH_YIELDS 100000
+
+static volatile u32int bench_yield_done;
+
+static void bench_yield_fn(void *arg)
+{
+	u32int i;
+	for (i = 0; i < BENCH_YIELDS; ++i)
+		task_yield();
+	bench_yield_done++;
+}
+
+void bench_yield()
+{
+	u32int switches = 0, ncpus = task_cpus;
+	u64int t;
+
+	// Две задачи с приоритетом kmain по очереди уступают друг другу
+	// процессор, каждый task_yield() - одно переключение контекста.
+	// Другие процессоры не должны забрать их себе
+	task_cpus = 1;
+	bench_yield_done = 0;
+	task_create("ping", &bench_yield_fn, 0, current_task->priority);
+	task_create("pong", &bench_yield_fn, 0, current_task->priority);
+	t = rdtsc();
+	while (bench_yield_done < 2)
+	{
+		task_yield();
+		switches++;
+	}
+	report("task_yield", rdtsc() - t, 2*BENCH_YIELDS + switches);
+	task_cpus = ncpus;
+}
+
+#define BENCH_FORK_TASKS	64
+#define BENCH_FORK_WORK		200000
+
+static volatile u32int bench_joined;
+static volatile u32int bench_sink;
+static wait_queue_t bench_join_wq = WAIT_QUEUE_INIT("bench join");
+
+static void bench_fork_fn(void *arg)
+{
+	u32int i, x = (u32int)arg;
+	for (i = 0; i < BENCH_FORK_WORK; ++i)
+		x = x*1103515245 + 12345;
+	bench_sink = x;
+	if (__sync_add_and_fetch(&bench_joined, 1) == BENCH_FORK_TASKS)
+		wake_up(&bench_join_wq);
+}
+
+void bench_fork_join()
+{
+	u32int n, i, one = 0, ncpus = task_cpus;
+	u64int t;
+
+	// Одна и та же порция задач на 1..smp_ncpus процессорах: все задачи
+	// создаются на BSP, остальные процессоры их воруют
+	for (n = 1; n <= smp_ncpus; ++n)
+	{
+		u32int cycles;
+		task_cpus = n;
+		bench_joined = 0;
+		t = rdtsc();
+		for (i = 0; i < BENCH_FORK_TASKS; ++i)
+			task_create("fork", &bench_fork_fn, (void*)i, current_task->priority);
+		// kmain спит, а не уступает процессор в цикле: процессор
+		// целиком достается задачам
+		wait_event(&bench_join_wq, bench_joined >= BENCH_FORK_TASKS);
+		cycles = (u32int)(rdtsc() - t);
+		if (n == 1)
+			one = cycles;
+		// Ускорение в сотых долях
+		kprintf("fork-join %u cpus: %u cycles/task, speedup %u.%02u\n", n,
+			cycles / BENCH_FORK_TASKS, one / (cycles / 100) / 100, one / (cycles / 100) % 100);
+	}
+	task_cpus = ncpus;
+}
+
+#define BENCH_LOCK_OPS		100000
+#define BENCH_LOCK_ROUNDS	20000
+
+static spinlock_t bench_spin = SPINLOCK_INIT("bench spin");
+static ticketlock_t bench_ticket = TICKETLOCK_INIT("bench ticket");
+static rwlock_t bench_rw = RWLOCK_INIT("bench rw");
+static volatile u32int bench_counter;
+static volatile u32int bench_lock_done;
+
+static void bench_spin_fn(void *arg)
+{
+	u32int i;
+	for (i = 0; i < BENCH_LOCK_ROUNDS; ++i)
+	{
+		spin_lock(&bench_spin);
+		bench_counter++;
+		spin_unlock(&bench_spin);
+	}
+	__sync_fetch_and_add(&bench_lock_done, 1);
+}
+
+static void bench_ticket_fn(void *arg)
+{
+	u32int i;
+	for (i = 0; i < BENCH_LOCK_ROUNDS; ++i)
+	{
+		ticket_lock(&bench_ticket);
+		bench_counter++;
+		ticket_unlock(&bench_ticket);
+	}
+	__sync_fetch_and_add(&bench_lock_done, 1);
+}
+
+// Задача на каждый процессор, все увеличивают один счетчик под
+// блокировкой. Счетчик заодно проверяет взаимное исключение
+static void bench_contended(char *name, task_fn fn)
+{
+	u32int i;
+	u64int t;
+
+	bench_counter = 0;
+	bench_lock_done = 0;
+	t = rdtsc();
+	for (i = 0; i < smp_ncpus; ++i)
+		task_create(name, fn, 0, current_task->priority);
+	while (bench_lock_done < smp_ncpus)
+		task_yield();
+	t = rdtsc() - t;
+	if (bench_counter != smp_ncpus*BENCH_LOCK_ROUNDS)
+		kprintf("  %s: lost updates (%u)\n", name, bench_counter);
+	report(name, t, smp_ncpus*BENCH_LOCK_ROUNDS);
+}
+
+void bench_locks()
+{
+	u32int i, flags;
+	u64int t;
+
+	t = rdtsc();
+	for (i = 0; i < BENCH_LOCK_OPS; ++i)
+	{
+		spin_lock(&bench_spin);
+		spin_unlock(&bench_spin);
+	}
+	report("spin_lock+unlock", rdtsc() - t, BENCH_LOCK_OPS);
+
+	t = rdtsc();
+	for (i = 0; i < BENCH_LOCK_OPS; ++i)
+	{
+		flags = spin_lock_irqsave(&bench_spin);
+		spin_unlock_irqrestore(&bench_spin, flags);
+	}
+	report("spin_lock_irqsave+restore", rdtsc() - t, BENCH_LOCK_OPS);
+
+	t = rdtsc();
+	for (i = 0; i < BENCH_LOCK_OPS; ++i)
+	{
+		ticket_lock(&bench_ticket);
+		ticket_unlock(&bench_ticket);
+	}
+	report("ticket_lock+unlock", rdtsc() - t, BENCH_LOCK_OPS);
+
+	t = rdtsc();
+	for (i = 0; i < BENCH_LOCK_OPS; ++i)
+	{
+		read_lock(&bench_rw);
+		read_unlock(&bench_rw);
+	}
+	report("read_lock+unlock", rdtsc() - t, BENCH_LOCK_OPS);
+
+	t = rdtsc();
+	for (i = 0; i < BENCH_LOCK_OPS; ++i)
+	{
+		write_lock(&bench_rw);
+		write_unlock(&bench_rw);
+	}
+	report("write_lock+unlock", rdtsc() - t, BENCH_LOCK_OPS);
+
+	bench_contended("spin contended", &bench_spin_fn);
+	bench_contended("ticket contended", &bench_ticket_fn);
+}
+
+#define BENCH_WAKEUPS	1000
+
+static wait_queue_t bench_wake_wq = WAIT_QUEUE_INIT("bench wake");
+static volatile u32int bench_wake_seq;
+static volatile u32int bench_woken_seq;
+static volatile u64int bench_wake_time;
+static u64int bench_wake_sum;
+static u32int bench_wake_max;
+
+// Засыпает BENCH_WAKEUPS раз и замеряет время от wake_up() до
+// возвращения из wait_event()
+static void bench_sleeper_fn(void *arg)
+{
+	u32int i, t;
+	for (i = 1; i <= BENCH_WAKEUPS; ++i)
+	{
+		wait_event(&bench_wake_wq, bench_wake_seq >= i);
+		t = (u32int)(rdtsc() - bench_wake_time);
+		bench_wake_sum += t;
+		if (t > bench_wake_max)
+			bench_wake_max = t;
+		bench_woken_seq = i;
+	}
+}
+
+// Если on_hlt, kmain ждет в цикле, и спящую задачу берет процессор,
+// стоящий в hlt: в задержку входит IPI и выход из hlt. Иначе все на
+// одном процессоре, и спящая задача важнее kmain - wake_up() сразу
+// переключается на нее
+static void bench_wakeup_run(char *name, int on_hlt)
+{
+	u32int i, ncpus = task_cpus, prio = current_task->priority;
+	task_t *sleeper;
+
+	task_cpus = on_hlt ? smp_ncpus : 1;
+	bench_wake_seq = bench_woken_seq = 0;
+	bench_wake_sum = 0;
+	bench_wake_max = 0;
+	sleeper = task_create("sleeper", &bench_sleeper_fn, 0, on_hlt ? prio : prio - 1);
+	for (i = 1; i <= BENCH_WAKEUPS; ++i)
+	{
+		// Будим, только когда задача уже ушла с процессора
+		while (!waitqueue_active(&bench_wake_wq) || sleeper->on_cpu)
+		{
+			if (on_hlt)
+				cpu_relax();
+			else
+				task_yield();
+		}
+		bench_wake_time = rdtsc();
+		bench_wake_seq = i;
+		wake_up(&bench_wake_wq);
+		while (bench_woken_seq != i)
+		{
+			if (on_hlt)
+				cpu_relax();
+			else
+				task_yield();
+		}
+	}
+	div64_32(&bench_wake_sum, BENCH_WAKEUPS);
+	kprintf("%s: %u cycles avg, %u max\n", name, (u32int)bench_wake_sum, bench_wake_max);
+	task_cpus = ncpus;
+}
+
+void bench_wakeup()
+{
+	bench_wakeup_run("wake_up same cpu", 0);
+	if (smp_ncpus > 1)
+		bench_wakeup_run("wake_up cpu in hlt", 1);
+}
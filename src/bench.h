@@ -0,0 +1,77 @@
+// bench.h -- Microbenchmarks run at boot when the kernel is built
+//            with 'make BENCH=1'
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include "common.h"
+
+/**
+ * Скорость выделения и освобождения кадров на 16 МБ, 512 МБ и 4 ГБ
+ * моделируемой памяти. Пересоздает битовую карту кадров, поэтому
+ * вызывается до initialise_paging()
+ */
+extern void bench_frames();
+
+/**
+ * Время clone_directory() в зависимости от числа отображенных
+ * страниц пользователя
+ */
+extern void bench_clone();
+
+/**
+ * Стоимость промахов TLB: обход 4 МБ памяти ядра после перезагрузки
+ * CR3 через отображение 4 кБ страницами и через 4 МБ глобальную страницу
+ */
+extern void bench_tlb();
+
+/**
+ * Скорость memcpy и memset (байт за такт) на блоках от 8 Б до 1 МБ
+ */
+extern void bench_mem();
+
+/**
+ * Пропускная способность консоли: тактов на строку при выводе
+ * по символу и строкой целиком
+ */
+extern void bench_console();
+
+/**
+ * Наибольшая задержка прерывания таймера, когда на другом IRQ
+ * выполняется медленная работа: в самом обработчике и в softirq
+ */
+extern void bench_irq_latency();
+
+/**
+ * Стоимость timer_add, timer_cancel и срабатывания таймера
+ * при 32768 взведенных таймерах
+ */
+extern void bench_timers();
+
+/**
+ * Задержка переключения контекста: тактов на task_yield(), когда
+ * две задачи уступают процессор друг другу
+ */
+extern void bench_yield();
+
+/**
+ * Масштабирование планировщика: время fork-join прогона из 64
+ * задач на 1..N процессорах и ускорение относительно одного.
+ * N - сколько процессоров запустилось, например 'qemu -smp 4'.
+ * Результаты в дереве не хранятся: их печатает каждый запуск
+ */
+extern void bench_fork_join();
+
+/**
+ * Стоимость захвата и освобождения каждой блокировки без конкуренции
+ * и спин- и билетной блокировки, когда за нее борются все процессоры
+ */
+extern void bench_locks();
+
+/**
+ * Задержка пробуждения: от wake_up() до возвращения спящей задачи
+ * из wait_event() - на том же процессоре и на процессоре, стоящем в hlt
+ */
+extern void bench_wakeup();
+
+#endif
@@ -11,6 +11,11 @@ MBOOT_HEADER_MAGIC	equ 0x1BADB002	; Специальный флаг для за
 MBOOT_HEADER_FLAGS	equ MBOOT_PAGE_ALIGN | MBOOT_MEM_INFO
 MBOOT_CHECKSUM		equ -(MBOOT_HEADER_MAGIC + MBOOT_HEADER_FLAGS)
 
+KERNEL_VIRTUAL_BASE	equ 0xC0000000	; Ядро работает в верхнем гигабайте (см. link.ld)
+KERNEL_PAGE_NUMBER	equ (KERNEL_VIRTUAL_BASE >> 22)
+BOOT_TABLES			equ 4			; Сколько 4 МБ отображает загрузочный каталог
+KERNEL_STACK_SIZE	equ 0x4000
+
 [BITS 32]		; загрузчик сам переводит процессор в защищенный режим
 
 [GLOBAL mboot]	; чтобы 'mboot' был доступен из кода на C
@@ -33,13 +38,67 @@ mboot:
 [GLOBAL start]				; объявляем метку точки вход глобальной
 [EXTERN kmain]				; адрес функции main
 
+; Загрузчик передает управление по физическому адресу (start_phys в link.ld),
+; страничная адресация выключена. Пока она не включена, обращаться к данным
+; можно только по адресам, уменьшенным на KERNEL_VIRTUAL_BASE.
 start:
-	push	ebx				; загрузить в стек адрес структуры, полученной от загрузчика
-	push	eax				; загрузить в стек идентификатор совместимого загрузчика
-	
-	; запускаем ядро
 	cli						; запрещаем прерывания
-	call	kmain			; вызываем функцию kmain
-	jmp		$				; Бесконечный цикл, чтобы процессор не начал выполнять 
-							; код (мусор), находящийся после кода ядра.
+	mov		esi, eax		; сохраняем идентификатор загрузчика
+	mov		edi, ebx		; и адрес структуры multiboot
+
+	; Заполняем загрузочные таблицы страниц: первые BOOT_TABLES*4 МБ
+	; физической памяти подряд
+	mov		edx, boot_page_tables - KERNEL_VIRTUAL_BASE
+	mov		eax, 0x003		; present, rw
+	mov		ecx, BOOT_TABLES * 1024
+.fill_tables:
+	mov		[edx], eax
+	add		eax, 0x1000
+	add		edx, 4
+	loop	.fill_tables
+
+	; Одни и те же таблицы отображают память и по адресу 0 (код ниже
+	; выполняется по физическим адресам), и по KERNEL_VIRTUAL_BASE
+	mov		edx, boot_page_directory - KERNEL_VIRTUAL_BASE
+	mov		eax, (boot_page_tables - KERNEL_VIRTUAL_BASE) + 0x003
+	xor		ecx, ecx
+.fill_directory:
+	mov		[edx + ecx*4], eax
+	mov		[edx + ecx*4 + KERNEL_PAGE_NUMBER*4], eax
+	add		eax, 0x1000
+	inc		ecx
+	cmp		ecx, BOOT_TABLES
+	jne		.fill_directory
+
+	mov		cr3, edx
+	mov		eax, cr0
+	or		eax, 0x80000000
+	mov		cr0, eax
+
+	; Переходим на виртуальные адреса
+	lea		eax, [higher_half]
+	jmp		eax
+
+higher_half:
+	mov		esp, kernel_stack_top
+	push	edi				; загрузить в стек адрес структуры, полученной от загрузчика
+	push	esi				; загрузить в стек идентификатор совместимого загрузчика
+
+	; запускаем ядро
+	call	kmain			; вызываем функцию kmain, она не возвращается
+.hang:						; На всякий случай останавливаем процессор, чтобы он не начал
+	cli						; выполнять код (мусор), находящийся после кода ядра.
+	hlt
+	jmp		.hang
 
+[SECTION .bss align=4096]
+; Загрузочный каталог страниц. initialise_paging() заменит его каталогом ядра,
+; в котором нижней половины адресного пространства уже нет.
+boot_page_directory:
+	resb	0x1000
+boot_page_tables:
+	resb	BOOT_TABLES * 0x1000
+kernel_stack:
+	resb	KERNEL_STACK_SIZE
+[GLOBAL kernel_stack_top]	; вершина стека BSP, для его TSS
+kernel_stack_top:
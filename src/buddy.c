@@ -0,0 +1,157 @@
+// buddy.c -- Binary buddy allocator for physically contiguous
+//            runs of frames
+//
+// The allocator does not keep its own free lists. The state of order 0
+// is the frames bitset from paging.c, and for every order k from 1 to
+// BUDDY_MAX_ORDER there is a bitmap with one bit per naturally aligned
+// block of 2^k frames, set while the whole block is free. set_frame()
+// and clear_frame() keep the maps up to date, so frames taken one by
+// one with alloc_frame() and blocks taken with alloc_pages() never
+// overlap, and freeing the last frame of a block coalesces it with its
+// buddy at once.
+
+#include "buddy.h"
+#include "paging.h"
+#include "kheap.h"
+
+#define WORDS_FOR_BITS(a) (((a)+31)/32)
+
+static u32int *buddy_free[BUDDY_MAX_ORDER+1];	// Index 0 is unused
+static u32int nblocks[BUDDY_MAX_ORDER+1];
+static u32int nwords[BUDDY_MAX_ORDER+1];
+// No free block of the order below this word of its map
+static u32int hint[BUDDY_MAX_ORDER+1];
+
+static u32int block_free(u32int order, u32int i)
+{
+	if (order == 0)
+		return i < nframes && !(frames[i/32] & (0x1 << (i%32)));
+	return buddy_free[order][i/32] & (0x1 << (i%32));
+}
+
+static void mark_free(u32int order, u32int i)
+{
+	buddy_free[order][i/32] |= 0x1 << (i%32);
+	if (i/32 < hint[order])
+		hint[order] = i/32;
+}
+
+void buddy_init()
+{
+	u32int k, i;
+	for (k = 1; k <= BUDDY_MAX_ORDER; ++k)
+	{
+		nblocks[k] = nframes >> k;
+		// One spare bit for the partial block at the end of memory
+		nwords[k] = WORDS_FOR_BITS(nblocks[k] + 1);
+		buddy_free[k] = (u32int*)kmalloc(nwords[k]*4);
+		memset(buddy_free[k], 0, nwords[k]*4);
+		hint[k] = 0;
+
+		for (i = 0; i < nblocks[k]; ++i)
+			if (block_free(k-1, 2*i) && block_free(k-1, 2*i+1))
+				mark_free(k, i);
+	}
+}
+
+void buddy_frame_used(u32int frame)
+{
+	u32int k;
+	// A used frame breaks every block containing it. Blocks above
+	// the first one already marked used can not be free either.
+	for (k = 1; k <= BUDDY_MAX_ORDER; ++k)
+	{
+		u32int i = frame >> k;
+		if (!block_free(k, i))
+			break;
+		buddy_free[k][i/32] &= ~(0x1 << (i%32));
+	}
+}
+
+void buddy_frame_freed(u32int frame)
+{
+	u32int k;
+	for (k = 1; k <= BUDDY_MAX_ORDER; ++k)
+	{
+		u32int i = frame >> k;
+		if (i >= nblocks[k])
+			break;
+		// Объединяем блок с соседом, если тот тоже свободен
+		if (!block_free(k-1, 2*i) || !block_free(k-1, 2*i+1))
+			break;
+		mark_free(k, i);
+	}
+}
+
+u32int alloc_pages(u32int order)
+{
+	u32int w, i, addr, flags;
+
+	if (order == 0)
+		return frame_alloc();
+	if (order > BUDDY_MAX_ORDER)
+		return (u32int)-1;
+
+	flags = spin_lock_irqsave(&frames_lock);
+	for (w = hint[order]; w < nwords[order]; ++w)
+		if (buddy_free[order][w])
+			break;
+	hint[order] = w;
+	if (w == nwords[order])
+	{
+		spin_unlock_irqrestore(&frames_lock, flags);
+		return (u32int)-1;
+	}
+
+	i = w*32 + bsf(buddy_free[order][w]);
+	addr = (i << order) * 0x1000;
+	for (i = 0; i < (0x1u << order); ++i)
+		set_frame(addr + i*0x1000);
+	spin_unlock_irqrestore(&frames_lock, flags);
+	return addr;
+}
+
+void free_pages(u32int addr, u32int order)
+{
+	u32int i, flags = spin_lock_irqsave(&frames_lock);
+	for (i = 0; i < (0x1u << order); ++i)
+		clear_frame(addr + i*0x1000);
+	spin_unlock_irqrestore(&frames_lock, flags);
+}
+
+void buddy_get_stats(buddy_stats_t *stats)
+{
+	u32int k, i;
+	u32int usable = 0;
+
+	memset(stats, 0, sizeof(buddy_stats_t));
+	stats->free_frames = nfree_frames;
+	stats->largest_order = -1;
+
+	for (k = 0; k <= BUDDY_MAX_ORDER; ++k)
+	{
+		u32int n = (k == 0) ? nframes : nblocks[k];
+		for (i = 0; i < n; ++i)
+		{
+			u32int empty = (k == 0) ? frames[i/32] == 0xFFFFFFFF : buddy_free[k][i/32] == 0;
+			if ((i % 32) == 0 && empty)
+			{
+				i += 31; // nothing free in this word
+				continue;
+			}
+			if (block_free(k, i) && (k == BUDDY_MAX_ORDER || !block_free(k+1, i/2)))
+				stats->free_blocks[k]++;
+		}
+		if (stats->free_blocks[k])
+			stats->largest_order = k;
+	}
+
+	// Frames in blocks of order k or larger can serve an order k
+	// request, the rest of the free memory can not.
+	for (k = BUDDY_MAX_ORDER + 1; k-- > 0; )
+	{
+		usable += stats->free_blocks[k] << k;
+		if (stats->free_frames)
+			stats->unusable[k] = (stats->free_frames - usable) * 1000 / stats->free_frames;
+	}
+}
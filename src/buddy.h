@@ -0,0 +1,55 @@
+// buddy.h -- Binary buddy allocator for physically contiguous
+//            runs of frames
+
+#ifndef BUDDY_H_
+#define BUDDY_H_
+
+#include "common.h"
+
+// Самый крупный блок - 2^10 кадров, т.е. 4 МБ
+#define BUDDY_MAX_ORDER 10
+
+typedef struct buddy_stats
+{
+	u32int free_frames;
+	// Количество свободных блоков каждого порядка, которые
+	// нельзя объединить с соседом в блок большего порядка
+	u32int free_blocks[BUDDY_MAX_ORDER+1];
+	// Доля свободной памяти (в промилле), которая не может быть
+	// выделена блоками данного порядка из-за фрагментации
+	u32int unusable[BUDDY_MAX_ORDER+1];
+	// Порядок самого крупного свободного блока, -1 если памяти нет
+	s32int largest_order;
+} buddy_stats_t;
+
+/**
+ * Строит карты свободных блоков по текущей битовой карте кадров.
+ * Вызывается из init_frames()
+ */
+extern void buddy_init();
+
+/**
+ * Вызываются из set_frame()/clear_frame() при каждом изменении
+ * состояния кадра. Свободные соседи объединяются автоматически
+ */
+extern void buddy_frame_used(u32int frame);
+extern void buddy_frame_freed(u32int frame);
+
+/**
+ * Выделяет 2^order физически непрерывных кадров, выровненных
+ * по своему размеру. Возвращает физический адрес первого кадра
+ * или -1, если блока такого размера нет
+ */
+extern u32int alloc_pages(u32int order);
+
+/**
+ * Освобождает блок, выделенный alloc_pages()
+ */
+extern void free_pages(u32int addr, u32int order);
+
+/**
+ * Заполняет статистику фрагментации
+ */
+extern void buddy_get_stats(buddy_stats_t *stats);
+
+#endif
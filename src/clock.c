@@ -0,0 +1,140 @@
+// clock.c -- Monotonic high-resolution clock based on the TSC
+
+#include "clock.h"
+
+#define PIT_HZ			1193182
+#define CALIBRATE_MS	10
+#define CALIBRATE_RUNS	3
+
+// ns = (такты * clock_mult) >> CLOCK_SHIFT
+#define CLOCK_SHIFT		24
+
+u32int tsc_khz = 0;
+int tsc_invariant = 0;
+
+static u32int clock_mult = 0;
+static u64int tsc_base = 0;		// Показание TSC в момент init_clock()
+
+// Для TSC с переменной частотой: время последнего тика таймера
+// и показание TSC в этот момент. 64-битные поля пишутся не атомарно,
+// поэтому читатели проверяют tick_seq: нечетный - идет запись, изменился
+// за время чтения - пара могла оказаться несогласованной
+static volatile u32int tick_seq = 0;
+static volatile u64int tick_ns = 0;
+static volatile u64int tick_tsc = 0;
+static volatile u32int tick_period = 0;
+
+// Число тактов TSC за CALIBRATE_MS миллисекунд по каналу 2 PIT
+static u32int calibrate_once()
+{
+	u32int count = PIT_HZ * CALIBRATE_MS / 1000;
+	u64int start, end;
+
+	// Вход GATE канала 2 - бит 0 порта 0x61, динамик (бит 1) выключен
+	outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+	outb(0x43, 0xB0);	// Канал 2, режим 0: выход поднимется по окончании счета
+	outb(0x42, count & 0xFF);
+	outb(0x42, count >> 8);
+
+	start = rdtsc();
+	// Выход канала 2 читается в бите 5 порта 0x61
+	while (!(inb(0x61) & 0x20))
+		;
+	end = rdtsc();
+	return (u32int)(end - start);
+}
+
+void init_clock()
+{
+	u32int eax, ebx, ecx, edx, best = 0xFFFFFFFF, i;
+	u64int t;
+
+	// Берем самый короткий замер: остальные могли растянуть SMI
+	for (i = 0; i < CALIBRATE_RUNS; ++i)
+	{
+		u32int cycles = calibrate_once();
+		if (cycles < best)
+			best = cycles;
+	}
+	// кГц = такты / (count / PIT_HZ) / 1000
+	t = (u64int)best * PIT_HZ;
+	div64_32(&t, (PIT_HZ * CALIBRATE_MS / 1000) * 1000);
+	tsc_khz = (u32int)t;
+
+	t = (u64int)1000000 << CLOCK_SHIFT;
+	div64_32(&t, tsc_khz);
+	clock_mult = (u32int)t;
+
+	cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+	if (eax >= 0x80000007)
+	{
+		cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+		tsc_invariant = (edx >> 8) & 0x1;
+	}
+
+	tsc_base = rdtsc();
+}
+
+u64int clock_tsc_to_ns(u64int tsc)
+{
+	return mul_u64_u32_shr(tsc - tsc_base, clock_mult, CLOCK_SHIFT);
+}
+
+void clock_tick(u32int period_ns)
+{
+	u64int tsc = rdtsc();
+
+	tick_seq++;
+	__asm__ volatile ("" : : : "memory");
+	// До первого тика время шло по TSC: продолжаем с того же места,
+	// иначе часы отскочат назад к нулю
+	if (!tick_period)
+		tick_ns = clock_tsc_to_ns(tsc);
+	else
+		tick_ns += period_ns;
+	tick_tsc = tsc;
+	tick_period = period_ns;
+	__asm__ volatile ("" : : : "memory");
+	tick_seq++;
+}
+
+u64int clock_ns()
+{
+	u64int ns, tsc, delta;
+	u32int seq, period;
+
+	if (tsc_invariant)
+		return clock_tsc_to_ns(rdtsc());
+
+	// Тик мог прийти между чтениями - повторяем, пока пара не согласована.
+	// Пишет только обработчик таймера, на x86 записи не переставляются
+	do
+	{
+		while ((seq = tick_seq) & 1)
+			cpu_relax();
+		__asm__ volatile ("" : : : "memory");
+		period = tick_period;
+		ns = tick_ns;
+		tsc = tick_tsc;
+		__asm__ volatile ("" : : : "memory");
+	} while (tick_seq != seq);
+
+	// Таймер не запущен - кроме TSC опереться не на что
+	if (!period)
+		return clock_tsc_to_ns(rdtsc());
+
+	// Частота TSC могла измениться: внутри тика не уходим
+	// дальше начала следующего, иначе время пойдет назад
+	delta = mul_u64_u32_shr(rdtsc() - tsc, clock_mult, CLOCK_SHIFT);
+	if (delta >= period)
+		delta = period - 1;
+	return ns + delta;
+}
+
+void udelay(u32int us)
+{
+	u64int cycles = (u64int)us * tsc_khz, start = rdtsc();
+	div64_32(&cycles, 1000);
+	while (rdtsc() - start < cycles)
+		cpu_relax();
+}
@@ -0,0 +1,45 @@
+// clock.h -- Monotonic high-resolution clock based on the TSC
+
+#ifndef CLOCK_H_
+#define CLOCK_H_
+
+#include "common.h"
+
+// Частота TSC в кГц, измеренная при загрузке
+extern u32int tsc_khz;
+
+// Не ноль, если частота TSC постоянна (invariant TSC)
+extern int tsc_invariant;
+
+/**
+ * Измеряет частоту TSC по каналу 2 PIT и выбирает источник
+ * времени. Вызывается один раз до первого clock_ns().
+ */
+extern void init_clock();
+
+/**
+ * Наносекунды с момента init_clock(). Не убывает. При постоянной
+ * частоте TSC - одно чтение TSC, умножение и сдвиг; иначе время
+ * отсчитывается тиками таймера, а TSC лишь уточняет его внутри тика.
+ */
+extern u64int clock_ns();
+
+/**
+ * Переводит показание TSC в наносекунды шкалы clock_ns()
+ * по измеренной частоте
+ */
+extern u64int clock_tsc_to_ns(u64int tsc);
+
+/**
+ * Сообщает часам о прошедшем тике таймера длиной period_ns.
+ * Вызывается из обработчика прерывания таймера.
+ */
+extern void clock_tick(u32int period_ns);
+
+/**
+ * Ждет не меньше us микросекунд, опрашивая TSC. Работает
+ * с выключенными прерываниями и до запуска таймера.
+ */
+extern void udelay(u32int us);
+
+#endif
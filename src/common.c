@@ -1,6 +1,7 @@
 // common.c -- Defines some global functions
 
 #include "common.h"
+#include "kprintf.h"
 
 // write a byte out to the specified port
 void outb(u16int port, u8int value)
@@ -22,11 +23,121 @@ u16int inw(u16int port)
 	return ret;
 }
 
+// Set by init_fpu() when the SSE path of memcpy/memset may be used
+static int sse_enabled = 0;
+
+// Blocks at least this long go through the SSE registers
+#define SSE_MIN_LEN		256
+// The SSE path runs with interrupts off (the kernel does not save
+// XMM registers on interrupt), so it works in chunks of this size
+#define SSE_CHUNK		0x1000
+
+// A page fault can still hit the middle of an SSE chunk, and the fault
+// handler copies and zeroes frames with memcpy/memset too. While a CPU
+// has its XMM registers in use, it marks that in cpu_t.sse_busy
+// (%gs:24) and nested calls take the scalar path. Only blocks of
+// SSE_MIN_LEN and more look at the flag: an AP zeroes its GDT and TSS
+// before its gs is set up, and those are shorter.
+static inline int sse_usable()
+{
+	u32int busy;
+	if (!sse_enabled)
+		return 0;
+	__asm__ volatile ("mov %%gs:24, %0" : "=r"(busy));
+	return !busy;
+}
+
+void init_fpu()
+{
+	u32int eax, ebx, ecx, edx, cr;
+
+	// CR0: EM=0 (FPU present), MP=1, NE=1 (native error reporting)
+	__asm__ volatile ("mov %%cr0, %0" : "=r"(cr));
+	cr = (cr & ~0x4) | 0x2 | 0x20;
+	__asm__ volatile ("mov %0, %%cr0" : : "r"(cr));
+	__asm__ volatile ("fninit");
+
+	// SSE требует поддержки fxsave/fxrstor (CR4.OSFXSR)
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+	if ((edx & (0x1 << 24)) && (edx & (0x1 << 25)))
+	{
+		__asm__ volatile ("mov %%cr4, %0" : "=r"(cr));
+		cr |= 0x200 | 0x400;	// CR4.OSFXSR, CR4.OSXMMEXCPT
+		__asm__ volatile ("mov %0, %%cr4" : : "r"(cr));
+		sse_enabled = 1;
+	}
+}
+
+// Copies len bytes (a multiple of 64) to a 16-byte aligned dest
+static void sse_copy(u8int *dp, const u8int *sp, u32int len)
+{
+	u32int flags;
+	__asm__ volatile ("pushf; pop %0; cli; movl $1, %%gs:24" : "=r"(flags) : : "memory");
+	for (; len; len -= 64, dp += 64, sp += 64)
+		__asm__ volatile (
+			"movups   (%1), %%xmm0\n\t"
+			"movups 16(%1), %%xmm1\n\t"
+			"movups 32(%1), %%xmm2\n\t"
+			"movups 48(%1), %%xmm3\n\t"
+			"movaps %%xmm0,   (%0)\n\t"
+			"movaps %%xmm1, 16(%0)\n\t"
+			"movaps %%xmm2, 32(%0)\n\t"
+			"movaps %%xmm3, 48(%0)"
+			: : "r"(dp), "r"(sp) : "memory");
+	__asm__ volatile ("movl $0, %%gs:24; push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+// Fills len bytes (a multiple of 64) at a 16-byte aligned dest
+static void sse_fill(u8int *dp, u32int pattern, u32int len)
+{
+	u32int flags;
+	u32int fill[4] = { pattern, pattern, pattern, pattern };
+	__asm__ volatile ("pushf; pop %0; cli; movl $1, %%gs:24" : "=r"(flags) : : "memory");
+	// Только SSE1: образец загружаем из памяти
+	__asm__ volatile ("movups (%0), %%xmm0" : : "r"(fill), "m"(fill));
+	for (; len; len -= 64, dp += 64)
+		__asm__ volatile (
+			"movaps %%xmm0,   (%0)\n\t"
+			"movaps %%xmm0, 16(%0)\n\t"
+			"movaps %%xmm0, 32(%0)\n\t"
+			"movaps %%xmm0, 48(%0)"
+			: : "r"(dp) : "memory");
+	__asm__ volatile ("movl $0, %%gs:24; push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
 // Copy len bytes from src to dest.
 void memcpy(void *dest, const void *src, u32int len)
 {
     const u8int *sp = (const u8int *)src;
     u8int *dp = (u8int *)dest;
+    u32int n;
+
+    if (len >= 16)
+    {
+        int sse = len >= SSE_MIN_LEN && sse_usable();
+        // Выравниваем приемник: невыровненные записи дороже чтений
+        n = -(u32int)dp & (sse ? 0xF : 0x3);
+        len -= n;
+        while (n--)
+            *dp++ = *sp++;
+
+        if (sse && len >= SSE_MIN_LEN)
+        {
+            while (len >= 64)
+            {
+                n = (len < SSE_CHUNK ? len : SSE_CHUNK) & ~0x3F;
+                sse_copy(dp, sp, n);
+                dp += n;
+                sp += n;
+                len -= n;
+            }
+        }
+
+        n = len / 4;
+        len &= 0x3;
+        __asm__ volatile ("rep movsl"
+            : "+D"(dp), "+S"(sp), "+c"(n) : : "memory");
+    }
     while(len--) 
 		*dp++ = *sp++;
 }
@@ -35,22 +146,90 @@ void memcpy(void *dest, const void *src, u32int len)
 void memset(void *dest, u8int val, u32int len)
 {
     u8int *temp = (u8int *)dest;
+    u32int pattern = val * 0x01010101;
+    u32int n;
+
+    if (len >= 16)
+    {
+        int sse = len >= SSE_MIN_LEN && sse_usable();
+        n = -(u32int)temp & (sse ? 0xF : 0x3);
+        len -= n;
+        while (n--)
+            *temp++ = val;
+
+        if (sse && len >= SSE_MIN_LEN)
+        {
+            while (len >= 64)
+            {
+                n = (len < SSE_CHUNK ? len : SSE_CHUNK) & ~0x3F;
+                sse_fill(temp, pattern, n);
+                temp += n;
+                len -= n;
+            }
+        }
+
+        n = len / 4;
+        len &= 0x3;
+        __asm__ volatile ("rep stosl"
+            : "+D"(temp), "+c"(n) : "a"(pattern) : "memory");
+    }
     while (len--) 
 		*temp++ = val;
 }
 
+// Compares len bytes, the result has the same sign as in strcmp.
+int memcmp(const void *s1, const void *s2, u32int len)
+{
+    const u8int *p1 = (const u8int *)s1;
+    const u8int *p2 = (const u8int *)s2;
+    for (; len; --len, ++p1, ++p2)
+        if (*p1 != *p2)
+            return *p1 - *p2;
+    return 0;
+}
+
+// Строки просматриваются по 4 байта. Слова читаются только по
+// выровненным адресам, поэтому чтение не выходит за страницу,
+// в которой лежит конец строки.
+#define HAS_ZERO(w) (((w) - 0x01010101) & ~(w) & 0x80808080)
+
+u32int strlen(const char *str)
+{
+	const char *p = str;
+	const u32int *w;
+
+	for (; (u32int)p & 0x3; ++p)
+		if (!*p)
+			return p - str;
+	for (w = (const u32int *)p; !HAS_ZERO(*w); ++w)
+		;
+	for (p = (const char *)w; *p; ++p)
+		;
+	return p - str;
+}
+
 // Returns an integral value indicating the relationship between the strings:
 // A zero value indicates that both strings are equal.
 // A value greater than zero indicates that the first character that does not 
 // match has a greater value in str1 than in str2; And a value less than zero indicates the opposite.
 int strcmp(const char *str1, const char *str2)
 {
-	register signed char __res;
-	while(1) {
-		if((__res = *str1 - *str2++) != 0 || *str1++)
-			break;
+	// Словами сравниваем, только если строки выровнены одинаково
+	if ((((u32int)str1 ^ (u32int)str2) & 0x3) == 0)
+	{
+		for (; (u32int)str1 & 0x3; ++str1, ++str2)
+			if (*str1 != *str2 || !*str1)
+				return (u8int)*str1 - (u8int)*str2;
+		while (*(const u32int *)str1 == *(const u32int *)str2 &&
+			   !HAS_ZERO(*(const u32int *)str1))
+		{
+			str1 += 4;
+			str2 += 4;
+		}
 	}
-	return __res;
+	for (; *str1 == *str2 && *str1; ++str1, ++str2)
+		;
+	return (u8int)*str1 - (u8int)*str2;
 }
 
 // Copy the NULL-terminated string src into dest, and
@@ -58,7 +237,21 @@ int strcmp(const char *str1, const char *str2)
 char *strcpy(char *dest, const char *src)
 {
 	char* tmp = dest;
+	u32int w;
 
+	for (; (u32int)src & 0x3; ++src)
+		if ((*dest++ = *src) == '\0')
+			return tmp;
+	// Выровнено читаем источник, запись может быть невыровненной
+	for (;;)
+	{
+		w = *(const u32int *)src;
+		if (HAS_ZERO(w))
+			break;
+		*(u32int *)dest = w;
+		dest += 4;
+		src += 4;
+	}
 	while((*dest++ = *src++) != '\0');
 
 	return tmp;
@@ -68,11 +261,16 @@ char *strcpy(char *dest, const char *src)
 // the end of dest, and return dest.
 char *strcat(char *dest, const char *src)
 {
-	char* tmp = dest;
-
-	while(*dest)
-		dest++;
-	while((*dest++ = *src++) != '\0');
+	strcpy(dest + strlen(dest), src);
+	return dest;
+}
 
-	return tmp;
+void panic(const char *message, const char *file, u32int line)
+{
+	__asm__ volatile ("cli");
+	kprintf("PANIC(%s) at %s:%u\n", message, file, line);
+	// hlt вместо пустого цикла: остановленный процессор не тратит
+	// время хоста. Разбудить его может только NMI - засыпаем снова
+	for (;;)
+		__asm__ volatile ("cli; hlt");
 }
@@ -6,6 +6,8 @@
 // Некоторые определения, чтобы стандартизировать типы
 // Эти типы определены для платформы x86
 #ifdef __i386__
+typedef unsigned long long	u64int;
+typedef          long long	s64int;
 typedef unsigned int	u32int;
 typedef          int	s32int;
 typedef unsigned short	u16int;
@@ -16,21 +18,116 @@ typedef          char	s8int;
 #error "Types for non-x86 not implemented."
 #endif
 
+// Ядро слинковано и работает по адресам выше KERNEL_VIRTUAL_BASE,
+// по которому отображено начало физической памяти (см. link.ld, boot.s)
+#define KERNEL_VIRTUAL_BASE	0xC0000000
+#define PHYS_TO_VIRT(a)		((u32int)(a) + KERNEL_VIRTUAL_BASE)
+#define VIRT_TO_PHYS(a)		((u32int)(a) - KERNEL_VIRTUAL_BASE)
+
 extern void outb(u16int port, u8int value);
 
 extern u8int inb(u16int port);
 
 extern u16int inw(u16int port);
 
+// Включает FPU и, если процессор их поддерживает, инструкции SSE,
+// которыми memcpy и memset копируют большие блоки
+extern void init_fpu();
+
 extern void memcpy(void *dest, const void *src, u32int len);
 
 extern void memset(void *dest, u8int val, u32int len);
 
+extern int memcmp(const void *s1, const void *s2, u32int len);
+
+extern u32int strlen(const char *str);
+
 extern int strcmp(const char *str1, const char *str2);
 
 extern char *strcpy(char *dest, const char *src);
 
 extern char *strcat(char *dest, const char *src);
 
+/**
+ * Сообщает о фатальной ошибке и останавливает процессор: прерывания
+ * выключаются, дальше только hlt. Не возвращается
+ */
+extern void panic(const char *message, const char *file, u32int line) __attribute__((noreturn));
+
+#define PANIC(msg) panic(msg, __FILE__, __LINE__)
+
+// Значение счетчика тактов процессора
+static inline u64int rdtsc()
+{
+	u64int ret;
+	__asm__ volatile ("rdtsc" : "=A" (ret));
+	return ret;
+}
+
+// Выполняет инструкцию cpuid для листа leaf
+static inline void cpuid(u32int leaf, u32int *eax, u32int *ebx, u32int *ecx, u32int *edx)
+{
+	__asm__ volatile ("cpuid"
+		: "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+		: "a" (leaf), "c" (0));
+}
+
+// Чтение и запись model-specific регистров
+static inline u64int rdmsr(u32int msr)
+{
+	u64int ret;
+	__asm__ volatile ("rdmsr" : "=A" (ret) : "c" (msr));
+	return ret;
+}
+
+static inline void wrmsr(u32int msr, u64int value)
+{
+	__asm__ volatile ("wrmsr" : : "c" (msr), "A" (value));
+}
+
+// Делит 64-битное n на d. Частное остается в n, возвращается остаток.
+// Деление 64-битных чисел компилятор превратил бы в вызов libgcc,
+// которой в ядре нет, поэтому делим двумя инструкциями div
+static inline u32int div64_32(u64int *n, u32int d)
+{
+	u32int high = (u32int)(*n >> 32), low, rem;
+	u32int qhigh = high / d;
+	__asm__ ("divl %4"
+		: "=a" (low), "=d" (rem)
+		: "a" ((u32int)*n), "d" (high % d), "rm" (d));
+	*n = ((u64int)qhigh << 32) | low;
+	return rem;
+}
+
+// (a * mul) >> shift без переполнения, shift не больше 32
+static inline u64int mul_u64_u32_shr(u64int a, u32int mul, u32int shift)
+{
+	u32int low = (u32int)a, high = (u32int)(a >> 32);
+	return (((u64int)low * mul) >> shift) + (((u64int)high * mul) << (32 - shift));
+}
+
+// Номер старшего установленного бита. x не должен быть равен нулю
+static inline u32int bsr(u32int x)
+{
+	u32int ret;
+	__asm__ ("bsr %1, %0" : "=r" (ret) : "rm" (x));
+	return ret;
+}
+
+// Номер младшего установленного бита. x не должен быть равен нулю
+static inline u32int bsf(u32int x)
+{
+	u32int ret;
+	__asm__ ("bsf %1, %0" : "=r" (ret) : "rm" (x));
+	return ret;
+}
+
+// Подсказка процессору внутри цикла ожидания: экономит энергию и
+// не мешает второму потоку ядра (инструкция pause)
+static inline void cpu_relax()
+{
+	__asm__ volatile ("pause" : : : "memory");
+}
+
 #endif
 
@@ -0,0 +1,25 @@
+// console.c -- Output backends that kernel messages are written to
+
+#include "console.h"
+#include "monitor.h"
+
+static console_t vga_console = { "vga", monitor_write_buf, 0 };
+
+static console_t *consoles = &vga_console;
+
+void console_register(console_t *con)
+{
+	console_t **link = &consoles;
+	// Порядок регистрации сохраняется
+	while (*link)
+		link = &(*link)->next;
+	con->next = 0;
+	*link = con;
+}
+
+void console_write(const char *buf, u32int len)
+{
+	console_t *con;
+	for (con = consoles; con; con = con->next)
+		con->write(buf, len);
+}
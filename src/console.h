@@ -0,0 +1,27 @@
+// console.h -- Output backends that kernel messages are written to
+
+#ifndef CONSOLE_H_
+#define CONSOLE_H_
+
+#include "common.h"
+
+typedef struct console
+{
+	char *name;
+	// Выводит len байт buf. Вызывается с уже отформатированным текстом
+	void (*write)(const char *buf, u32int len);
+	struct console *next;
+} console_t;
+
+/**
+ * Добавляет backend в список. Экран (VGA) зарегистрирован с самого
+ * начала, так что выводить можно еще до инициализации остальных.
+ */
+extern void console_register(console_t *con);
+
+/**
+ * Передает len байт buf каждому зарегистрированному backend'у
+ */
+extern void console_write(const char *buf, u32int len);
+
+#endif
@@ -5,12 +5,17 @@
 
 #include "common.h"
 #include "descriptor_tables.h"
+#include "smp.h"
 
 // Сделаем доступными наши функции из кода на ассемблере
 extern void gdt_flush(u32int);
+extern void tss_flush();
 
-static void init_gdt();
-static void gdt_set_gate(s32int,u32int,u32int,u8int,u8int);
+// Вершина стека BSP (boot.s)
+extern u8int kernel_stack_top[];
+
+static void init_gdt(cpu_t *cpu);
+static void gdt_set_gate(gdt_entry_t*,s32int,u32int,u32int,u8int,u8int);
 
 // Сделаем доступной функцию из кода на ассемблере
 extern void idt_flush(u32int);
@@ -18,45 +23,63 @@ extern void idt_flush(u32int);
 static void init_idt();
 static void idt_set_gate(u8int,u32int,u16int,u8int);
 
-gdt_entry_t	gdt_entries[5];
-gdt_ptr_t	gdt_ptr;
 idt_entry_t	idt_entries[256];
 idt_ptr_t	idt_ptr;
 
 void init_descriptor_tables()
 {
 	// Инициализируем таблицу GDT
-	init_gdt();
+	boot_cpu.stack = (u32int)kernel_stack_top;
+	init_gdt(&boot_cpu);
 	// и таблицу IDT
 	init_idt();
 }
 
-static void init_gdt()
+void init_cpu_descriptor_tables(cpu_t *cpu)
 {
-	gdt_ptr.limit = (sizeof(gdt_entry_t)*5) - 1;
-	gdt_ptr.base  = (u32int)&gdt_entries;
-
-	gdt_set_gate(0, 0, 0, 0, 0);				// Нулевой сегмент
-	gdt_set_gate(1, 0, 0xFFFFFFFF, 0x9A, 0xCF);	// Сегмент кода
-	gdt_set_gate(2, 0, 0xFFFFFFFF, 0x92, 0xCF);	// Сегмент данных
-	gdt_set_gate(3, 0, 0xFFFFFFFF, 0xFA, 0xCF);	// Сегмент кода уровня пользовательских процессов
-	gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF);	// Сегмент данных уровня пользовательских процессов
+	init_gdt(cpu);
+	idt_flush((u32int)&idt_ptr);
+}
 
-	gdt_flush((u32int)&gdt_ptr);
+static void init_gdt(cpu_t *cpu)
+{
+	gdt_entry_t *gdt = cpu->gdt;
+
+	cpu->self = cpu;
+	cpu->gdt_ptr.limit = (sizeof(gdt_entry_t)*GDT_ENTRIES) - 1;
+	cpu->gdt_ptr.base  = (u32int)gdt;
+
+	memset(&cpu->tss, 0, sizeof(tss_entry_t));
+	cpu->tss.ss0 = GDT_KERNEL_DATA;
+	cpu->tss.esp0 = cpu->stack;
+	cpu->tss.iomap_base = sizeof(tss_entry_t);
+
+	gdt_set_gate(gdt, 0, 0, 0, 0, 0);				// Нулевой сегмент
+	gdt_set_gate(gdt, 1, 0, 0xFFFFFFFF, 0x9A, 0xCF);	// Сегмент кода
+	gdt_set_gate(gdt, 2, 0, 0xFFFFFFFF, 0x92, 0xCF);	// Сегмент данных
+	gdt_set_gate(gdt, 3, 0, 0xFFFFFFFF, 0xFA, 0xCF);	// Сегмент кода уровня пользовательских процессов
+	gdt_set_gate(gdt, 4, 0, 0xFFFFFFFF, 0xF2, 0xCF);	// Сегмент данных уровня пользовательских процессов
+	// TSS процессора: доступный 32-битный TSS, байтовая гранулярность
+	gdt_set_gate(gdt, 5, (u32int)&cpu->tss, sizeof(tss_entry_t) - 1, 0x89, 0x00);
+	// Данные процессора: %gs:0 - начало его структуры cpu_t
+	gdt_set_gate(gdt, 6, (u32int)cpu, sizeof(cpu_t) - 1, 0x92, 0x40);
+
+	gdt_flush((u32int)&cpu->gdt_ptr);
+	tss_flush();
 }
 
 // Установить значение одной записи GDT
-static void gdt_set_gate(s32int num, u32int base, u32int limit, u8int access, u8int gran)
+static void gdt_set_gate(gdt_entry_t *gdt, s32int num, u32int base, u32int limit, u8int access, u8int gran)
 {
-	gdt_entries[num].base_low	 = (base & 0xFFFF);
-	gdt_entries[num].base_middle = (base >> 16) & 0xFF;
-	gdt_entries[num].base_high	 = (base >> 24) & 0xFF;
+	gdt[num].base_low	 = (base & 0xFFFF);
+	gdt[num].base_middle = (base >> 16) & 0xFF;
+	gdt[num].base_high	 = (base >> 24) & 0xFF;
 
-	gdt_entries[num].limit_low	 = (limit & 0xFFFF);
-	gdt_entries[num].granularity = (limit >> 16) & 0x0F;
+	gdt[num].limit_low	 = (limit & 0xFFFF);
+	gdt[num].granularity = (limit >> 16) & 0x0F;
 
-	gdt_entries[num].granularity |= gran & 0xF0;
-	gdt_entries[num].access		 = access;
+	gdt[num].granularity |= gran & 0xF0;
+	gdt[num].access		 = access;
 }
 
 static void init_idt()
@@ -76,7 +99,7 @@ static void init_idt()
 	outb(0xA1,0x02);
 	// Set 8086 mode
 	outb(0x21,0x01);
-	outb(0x21,0x01);
+	outb(0xA1,0x01);
 	// End of mess
 	outb(0x21,0x00);
 	outb(0xA1,0x00);
@@ -133,6 +156,11 @@ static void init_idt()
 	idt_set_gate( 46, (u32int)irq14, 0x08, 0x8E);
 	idt_set_gate( 47, (u32int)irq15, 0x08, 0x8E);
 
+	idt_set_gate(IRQ_LAPIC_TIMER, (u32int)irq_lapic_timer, 0x08, 0x8E);
+	idt_set_gate(IRQ_RESCHED, (u32int)irq_resched, 0x08, 0x8E);
+	idt_set_gate(IRQ_TLB_SHOOTDOWN, (u32int)irq_tlb_shootdown, 0x08, 0x8E);
+	idt_set_gate(255, (u32int)isr_spurious, 0x08, 0x8E);
+
 	idt_flush((u32int)&idt_ptr);
 }
 
@@ -1,10 +1,31 @@
 // descriptor_tables.h 
 
+#ifndef DESCRIPTOR_TABLES_H_
+#define DESCRIPTOR_TABLES_H_
+
 #include "common.h"
 
-// Инициализирующая функция
+// Записи GDT. Каждый процессор получает собственную копию таблицы:
+// в ней отличаются только TSS и сегмент его данных
+#define GDT_ENTRIES		7
+#define GDT_KERNEL_CODE	0x08
+#define GDT_KERNEL_DATA	0x10
+#define GDT_TSS			0x28
+#define GDT_PERCPU		0x30	// Данные процессора, загружается в gs
+
+struct cpu;
+
+// Инициализирующая функция. GDT и TSS строятся для процессора,
+// на котором запущено ядро, IDT одна на все процессоры
 extern void init_descriptor_tables();
 
+/**
+ * Загружает на текущем процессоре его собственные GDT и TSS
+ * из структуры cpu, сегмент данных процессора в gs и общую IDT.
+ * Вызывается каждым AP при запуске
+ */
+extern void init_cpu_descriptor_tables(struct cpu *cpu);
+
 // Эта структура содержит значения для одной записи GDT
 struct gdt_entry_struct {
 	u16int limit_low;	// Младшие 16 бит смещения
@@ -24,6 +45,29 @@ struct gdt_ptr_struct {
 
 typedef struct gdt_ptr_struct gdt_ptr_t;
 
+// Task State Segment. Процессор берет из него только стек ядра
+// (ss0:esp0) при переходе из кольца 3; переключение задач
+// выполняет ядро
+struct tss_entry_struct {
+	u32int prev_tss;
+	u32int esp0;		// Стек, на который процессор переходит
+	u32int ss0;			// при прерывании в пользовательском режиме
+	u32int esp1;
+	u32int ss1;
+	u32int esp2;
+	u32int ss2;
+	u32int cr3;
+	u32int eip;
+	u32int eflags;
+	u32int eax, ecx, edx, ebx, esp, ebp, esi, edi;
+	u32int es, cs, ss, ds, fs, gs;
+	u32int ldt;
+	u16int trap;
+	u16int iomap_base;	// Смещение карты портов: за концом TSS - карты нет
+} __attribute__((packed));
+
+typedef struct tss_entry_struct tss_entry_t;
+
 // Структура описывает запись в IDT
 struct idt_entry_struct {
 	u16int base_lo;		// Первые 16 бит адреса начала обработчика прерывания
@@ -78,6 +122,7 @@ extern void isr28();
 extern void isr29();
 extern void isr30();
 extern void isr31();
+extern void isr_spurious();
 
 // IRQ handlers
 extern void irq0 ();
@@ -96,4 +141,8 @@ extern void irq12();
 extern void irq13();
 extern void irq14();
 extern void irq15();
+extern void irq_lapic_timer();
+extern void irq_resched();
+extern void irq_tlb_shootdown();
 
+#endif
@@ -13,12 +13,20 @@ gdt_flush:
 	mov ds, ax
 	mov es, ax
 	mov fs, ax
-	mov gs, ax
 	mov ss, ax
+	mov ax, 0x30			; 0x30 - данные этого процессора (cpu_t)
+	mov gs, ax
 	jmp 0x08:.flush			; 0x08 - смещение для нашего сегмента кода: дальний переход
 	.flush:
 	ret
 
+[GLOBAL tss_flush]
+
+tss_flush:
+	mov ax, 0x28			; 0x28 - смещение TSS в GDT
+	ltr ax					; ltr помечает дескриптор занятым, поэтому у каждого
+	ret						; процессора свой TSS
+
 [GLOBAL idt_flush]			; позволяет вызвать idt_flsuh из кода на С
 
 idt_flush:
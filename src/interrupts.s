@@ -24,6 +24,16 @@ irq%1:
 	jmp irq_common_stub
 %endmacro
 
+; Векторы local APIC больше 127: push byte расширил бы их знаком
+%macro APIC_IRQ 2
+[GLOBAL %1]
+%1:
+	cli
+	push byte 0
+	push dword %2
+	jmp irq_common_stub
+%endmacro
+
 ISR_NOERRCODE 0
 ISR_NOERRCODE 1
 ISR_NOERRCODE 2
@@ -68,16 +78,16 @@ isr_common_stub:
 	mov ax, 0x10	; загружаем смещение для сегмента данных ядра
 	mov ds, ax
 	mov es, ax
-	mov fs, ax
-	mov gs, ax
+	mov fs, ax		; gs не трогаем: в нем данные процессора
 
+	push esp		; аргумент обработчика - указатель на сохраненные регистры
 	call isr_handler
+	add esp, 4
 
 	pop eax			; возвращаем оригинальное значение сегмента данных
 	mov ds, ax
 	mov es, ax
 	mov fs, ax
-	mov gs, ax
 
 	popa
 	add esp,8		; очищаем стек от значений кода ошибки и номера вектора прерывания
@@ -101,6 +111,10 @@ IRQ	13,	45
 IRQ	14,	46
 IRQ	15,	47
 
+APIC_IRQ	irq_lapic_timer,	0xEF
+APIC_IRQ	irq_resched,		0xF0
+APIC_IRQ	irq_tlb_shootdown,	0xF1
+
 [EXTERN irq_handler]
 
 irq_common_stub:
@@ -112,19 +126,25 @@ irq_common_stub:
 	mov ax, 0x10	; загружаем смещение для сегмента данных ядра
 	mov ds, ax
 	mov es, ax
-	mov fs, ax
-	mov gs, ax
+	mov fs, ax		; gs не трогаем: в нем данные процессора
 
+	push esp		; аргумент обработчика - указатель на сохраненные регистры
 	call irq_handler
+	add esp, 4
 
 	pop ebx			; возвращаем оригинальное значение сегмента данных
 	mov ds, bx
 	mov es, bx
 	mov fs, bx
-	mov gs, bx
 
 	popa
 	add esp,8		; очищаем стек от значений кода ошибки и номера вектора прерывания
 	sti
 	iret
 
+
+; Local APIC выдает этот вектор, когда прерывание исчезло раньше,
+; чем процессор его принял. EOI в этом случае не посылается.
+[GLOBAL isr_spurious]
+isr_spurious:
+	iret
@@ -4,41 +4,78 @@
 
 #include "common.h"
 #include "isr.h"
-#include "monitor.h"
+#include "kprintf.h"
+#include "klog.h"
+#include "softirq.h"
+#include "apic.h"
+#include "task.h"
 
 static isr_t interrupt_handlers[256];
 
-// Данная функция вызывается из нашего обработчика из файла interrupt.h
-void isr_handler(registers_t regs)
+// У каждого процессора свои счетчики: обработчики на разных
+// процессорах не пишут в одни и те же строки кэша и не теряют
+// инкременты. dump_interrupt_stats() складывает их
+static isr_stats_t interrupt_stats[SMP_MAX_CPUS][256];
+
+// Вызывает обработчик вектора и учитывает его время
+static inline void dispatch(registers_t *regs)
 {
-	monitor_write("recieved interrupt: ");
-	monitor_write_dec(regs.int_no);
-	monitor_put('\n');
+	isr_t handler = interrupt_handlers[regs->int_no];
+	isr_stats_t *stats = &interrupt_stats[smp_processor_id()][regs->int_no];
+	u64int start = rdtsc();
 
-	if(interrupt_handlers[regs.int_no] != 0)
-	{
-		isr_t handler = interrupt_handlers[regs.int_no];
+	if (handler)
 		handler(regs);
-	}
+	stats->count++;
+	stats->cycles += rdtsc() - start;
 }
 
-void irq_handler(registers_t regs)
+// Данная функция вызывается из нашего обработчика из файла interrupt.h
+void isr_handler(registers_t *regs)
 {
-	// Посылаем контроллеру прерываний сигнал EOI (end of interrupt)
-	// если прерываний пришло от второго контроллера (slave)
-	if (regs.int_no >= 40)
+	// Исключение без обработчика: вернуться - значит снова выполнить
+	// ту же инструкцию, поэтому останавливаемся
+	if (regs->int_no < 32 && !interrupt_handlers[regs->int_no])
 	{
-		// Посылаем сигнал reset второму контроллеру (slave)
-		outb(0xA0,0x20);
+		kprintf("Unhandled exception %u, error code %x, eip %p\n",
+			regs->int_no, regs->err_code, (void*)regs->eip);
+		klog_dump();
+		PANIC("Unhandled exception");
 	}
-	// первому контроллеру (master) посылаем сигнал reset в любом случае
-	outb(0x20,0x20);
+	dispatch(regs);
+}
+
+void irq_handler(registers_t *regs)
+{
+	// Пока обработчик не вернется, задача не сменит процессор
+	cpu_t *cpu = this_cpu();
+
+	cpu->irq_nesting++;
 
-	if(interrupt_handlers[regs.int_no] != 0)
+	// Посылаем контроллеру прерываний сигнал EOI (end of interrupt)
+	if (apic_active)
+		apic_eoi();
+	else
 	{
-		isr_t handler = interrupt_handlers[regs.int_no];
-		handler(regs);
+		// если прерываний пришло от второго контроллера (slave)
+		if (regs->int_no >= 40)
+		{
+			// Посылаем сигнал reset второму контроллеру (slave)
+			outb(0xA0,0x20);
+		}
+		// первому контроллеру (master) посылаем сигнал reset в любом случае
+		outb(0x20,0x20);
 	}
+
+	dispatch(regs);
+
+	// Отложенная часть работы - уже после EOI и с sti
+	do_softirq();
+
+	// Вытесняем задачу только на выходе из внешнего прерывания:
+	// вложенное прервало отложенную работу, а не задачу
+	if (!--cpu->irq_nesting && cpu->need_resched && !cpu->preempt_count)
+		schedule();
 }
 
 void register_interrupt_handler(u8int n, isr_t handler)
@@ -46,3 +83,29 @@ void register_interrupt_handler(u8int n, isr_t handler)
 	interrupt_handlers[n] = handler;
 }
 
+
+void dump_interrupt_stats()
+{
+	u32int i, cpu;
+	kprintf("vector      count  cycles/call\n");
+	for (i = 0; i < 256; ++i)
+	{
+		isr_stats_t stats = { 0, 0 };
+		u32int shift = 0;
+		for (cpu = 0; cpu < SMP_MAX_CPUS; ++cpu)
+		{
+			stats.count += interrupt_stats[cpu][i].count;
+			stats.cycles += interrupt_stats[cpu][i].cycles;
+		}
+		if (!stats.count)
+			continue;
+		// Делим только 32-битные числа: сумму сокращаем до 32 бит
+		while (stats.cycles >> 32)
+		{
+			stats.cycles >>= 1;
+			++shift;
+		}
+		kprintf("%6u %10u %12u\n", i, stats.count,
+			((u32int)stats.cycles / stats.count) << shift);
+	}
+}
@@ -1,5 +1,8 @@
 // isr.h
 
+#ifndef ISR_H_
+#define ISR_H_
+
 #include "common.h"
 
 // Make our life easier
@@ -20,6 +23,15 @@
 #define IRQ14 46
 #define IRQ15 47
 
+// Векторы local APIC: таймер процессора и межпроцессорные
+// прерывания "пересмотри очередь задач" и "сбрось TLB"
+#define IRQ_LAPIC_TIMER 0xEF
+#define IRQ_RESCHED 0xF0
+#define IRQ_TLB_SHOOTDOWN 0xF1
+
+// Ложные прерывания local APIC: подтверждать их не нужно
+#define IRQ_SPURIOUS 255
+
 typedef struct registers {
 	u32int ds;		// Селектор сегмента данных
 	u32int edi, esi, ebp, esp, ebx, edx, ecx, eax;
@@ -27,7 +39,23 @@ typedef struct registers {
 	u32int eip,cs,eflags,useresp,ss;
 } registers_t;
 
-typedef void (*isr_t)(registers_t);
+// Обработчик получает указатель на регистры, сохраненные в стеке
+// заглушкой из interrupts.s. Изменения в них попадут в прерванный код
+typedef void (*isr_t)(registers_t *);
 
 extern void register_interrupt_handler(u8int n, isr_t handler);
 
+// Статистика по вектору: число вызовов и такты, проведенные в обработчике
+typedef struct isr_stats
+{
+	u32int count;
+	u64int cycles;
+} isr_stats_t;
+
+/**
+ * Выводит статистику по всем векторам, которые хотя бы раз сработали
+ */
+extern void dump_interrupt_stats();
+
+#endif
+
@@ -4,18 +4,266 @@
 //            Written for JamesM's kernel development tutorials.
 
 #include "kheap.h"
+#include "paging.h"
+#include "spinlock.h"
 
 // end is defined in the linker script.
 extern u32int end;
 u32int placement_address = (u32int)&end;
 
+// Defined in paging.c
+extern page_directory_t *kernel_directory;
+
+#define HEAP_PAGES ((KHEAP_END - KHEAP_START) / 0x1000)
+
+// Small objects live in slabs: one heap page per slab, starting with
+// this header and followed by equally sized objects. Object addresses
+// are therefore never page-aligned, which is how kfree() tells them
+// apart from page-backed chunks.
+typedef struct slab
+{
+	struct slab *next;			// Neighbours in the cache's partial list
+	struct slab *prev;
+	struct kmem_cache *cache;	// Cache this slab belongs to
+	void *free;					// Singly linked list of free objects
+	u32int inuse;				// Number of handed out objects
+} slab_t;
+
+typedef struct kmem_cache
+{
+	u32int size;				// Object size
+	slab_t *partial;			// Slabs with at least one free object
+	u32int nempty;				// How many of them are completely free
+} kmem_cache_t;
+
+// Size classes: 16, 32, 64, ..., KHEAP_SLAB_MAX bytes
+#define SLAB_MIN_SHIFT	4
+#define SLAB_NCLASSES	7
+// Offset of the first object in a slab page (sizeof(slab_t) rounded up)
+#define SLAB_OBJ_OFFSET	32
+
+static kmem_cache_t caches[SLAB_NCLASSES];
+
+static int heap_ready = 0;
+
+// Serializes the heap and placement_address between CPUs. A ticket
+// lock, so a CPU hammering kmalloc cannot starve the others. Interrupts
+// stay off while it is held: finish_switch() frees task stacks with
+// interrupts disabled, so an interrupt handler spinning on it would
+// never get it back.
+static ticketlock_t heap_lock = TICKETLOCK_INIT("heap");
+
+// Page-level bookkeeping. Both arrays live in the first pages of the
+// heap range itself, mapped by init_kheap().
+static u16int *heap_run;	// Length of every page run, indexed by its first page
+static u32int *heap_map;	// A bitset of heap pages - used or free
+static u32int heap_hint;	// No free page below this word of heap_map
+static u32int heap_meta_pages;
+
+// Find n consecutive free pages, returns the index of the first one
+// or -1 if the heap range is exhausted.
+static u32int find_heap_pages(u32int n)
+{
+	u32int i, run = 0;
+	for (i = heap_hint * 32; i < HEAP_PAGES; ++i)
+	{
+		if (run == 0 && (i % 32) == 0 && heap_map[i/32] == 0xFFFFFFFF)
+		{
+			i += 31; // nothing free in this word, skip it
+			continue;
+		}
+		if (heap_map[i/32] & (0x1 << (i%32)))
+			run = 0;
+		else if (++run == n)
+			return i - n + 1;
+	}
+	return (u32int)-1;
+}
+
+// Back n consecutive heap pages with frames, returns their address or 0
+// if either the heap range or physical memory is exhausted.
+static u32int alloc_heap_pages(u32int n)
+{
+	u32int idx, i, frame;
+	if (n == 0)
+		n = 1;
+	if (n > 0xFFFF)
+		return 0; // heap_run can not describe such a run
+	idx = find_heap_pages(n);
+	if (idx == (u32int)-1)
+		return 0;
+
+	for (i = idx; i < idx + n; ++i)
+	{
+		page_t *page = get_page(KHEAP_START + i*0x1000, 1, kernel_directory);
+		if ((frame = frame_alloc()) == (u32int)-1)
+		{
+			// Out of memory: give back what this run already took.
+			// Nobody has seen these pages yet, a local invlpg is enough
+			while (i-- > idx)
+			{
+				page = get_page(KHEAP_START + i*0x1000, 0, kernel_directory);
+				frame_free(page->frame*0x1000);
+				*(u32int*)page = 0;
+				invlpg(KHEAP_START + i*0x1000);
+			}
+			return 0;
+		}
+		// Таблицы кучи общие для всех каталогов
+		*(u32int*)page = frame | PAGE_PRESENT | PAGE_RW | PAGE_GLOBAL;
+	}
+	for (i = idx; i < idx + n; ++i)
+		heap_map[i/32] |= 0x1 << (i%32);
+	heap_run[idx] = n;
+
+	while (heap_hint < HEAP_PAGES/32 && heap_map[heap_hint] == 0xFFFFFFFF)
+		++heap_hint;
+
+	return KHEAP_START + idx*0x1000;
+}
+
+// Give the frames of a page run back and unmap it. Other CPUs may
+// still cache the translations, so the frames are freed only after
+// tlb_shootdown(): until then a stale entry could still reach them.
+static void free_heap_pages(u32int addr)
+{
+	u32int idx = (addr - KHEAP_START) / 0x1000;
+	u32int n = heap_run[idx], i, a;
+
+	heap_run[idx] = 0;
+	for (i = 0, a = addr; i < n; ++i, a += 0x1000)
+	{
+		get_page(a, 0, kernel_directory)->present = 0;
+		invlpg(a);
+	}
+	tlb_shootdown(1);
+	for (i = idx; i < idx + n; ++i, addr += 0x1000)
+	{
+		free_frame(get_page(addr, 0, kernel_directory));
+		heap_map[i/32] &= ~(0x1 << (i%32));
+	}
+
+	if (idx/32 < heap_hint)
+		heap_hint = idx/32;
+}
+
+static kmem_cache_t *size_to_cache(u32int sz)
+{
+	u32int shift = SLAB_MIN_SHIFT;
+	if (sz > (0x1 << SLAB_MIN_SHIFT))
+		shift = bsr(sz - 1) + 1;
+	return &caches[shift - SLAB_MIN_SHIFT];
+}
+
+static void slab_unlink(kmem_cache_t *cache, slab_t *slab)
+{
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		cache->partial = slab->next;
+	if (slab->next)
+		slab->next->prev = slab->prev;
+}
+
+static void slab_push(kmem_cache_t *cache, slab_t *slab)
+{
+	slab->prev = 0;
+	slab->next = cache->partial;
+	if (cache->partial)
+		cache->partial->prev = slab;
+	cache->partial = slab;
+}
+
+static void *slab_alloc(kmem_cache_t *cache)
+{
+	slab_t *slab = cache->partial;
+	void *obj;
+
+	if (!slab)
+	{
+		// Нет свободных объектов - нарезаем новую страницу
+		u32int n = (0x1000 - SLAB_OBJ_OFFSET) / cache->size;
+		u32int base;
+
+		slab = (slab_t*)alloc_heap_pages(1);
+		if (!slab)
+			return 0;
+		slab->cache = cache;
+		slab->inuse = 0;
+		slab->free = 0;
+		base = (u32int)slab + SLAB_OBJ_OFFSET;
+		while (n--)
+		{
+			void **o = (void**)(base + n*cache->size);
+			*o = slab->free;
+			slab->free = o;
+		}
+		slab_push(cache, slab);
+		cache->nempty++;
+	}
+
+	obj = slab->free;
+	slab->free = *(void**)obj;
+	if (slab->inuse++ == 0)
+		cache->nempty--;
+	if (!slab->free)
+		slab_unlink(cache, slab); // slab is full now
+	return obj;
+}
+
+static void slab_free(void *obj)
+{
+	slab_t *slab = (slab_t*)((u32int)obj & 0xFFFFF000);
+	kmem_cache_t *cache = slab->cache;
+
+	if (!slab->free)
+		slab_push(cache, slab); // slab was full, make it available again
+	*(void**)obj = slab->free;
+	slab->free = obj;
+
+	if (--slab->inuse == 0)
+	{
+		// Keep one empty slab around so that an alloc/free pair
+		// on the boundary does not map and unmap a page each time.
+		if (cache->nempty)
+		{
+			slab_unlink(cache, slab);
+			free_heap_pages((u32int)slab);
+		}
+		else
+			cache->nempty++;
+	}
+}
+
 u32int kmalloc_int(u32int sz, int align, u32int *phys)
 {
-    // This will eventually call malloc() on the kernel heap.
-    // For now, though, we just assign memory at placement_address
-    // and increment it by sz. Even when we've coded our kernel
-    // heap, this will be useful for use before the heap is initialised.
-    if (align == 1 && (placement_address & 0xFFFFF000) )
+    if (heap_ready)
+    {
+        u32int addr, flags;
+        // Frames behind a heap run are not contiguous, a single
+        // physical address only describes the first page
+        if (phys && sz > 0x1000)
+            return 0;
+        // The caches and the page map are shared by all CPUs
+        flags = ticket_lock_irqsave(&heap_lock);
+        if (align == 1 || sz > KHEAP_SLAB_MAX)
+            addr = alloc_heap_pages((sz + 0xFFF) / 0x1000);
+        else
+            addr = (u32int)slab_alloc(size_to_cache(sz));
+        ticket_unlock_irqrestore(&heap_lock, flags);
+        if (addr && phys)
+        {
+            page_t *page = get_page(addr, 0, kernel_directory);
+            *phys = page->frame*0x1000 + (addr & 0xFFF);
+        }
+        return addr;
+    }
+
+    // The heap is not up yet, so we just assign memory at
+    // placement_address and increment it by sz. Everything
+    // allocated this way stays in use forever.
+    u32int tmp, flags = ticket_lock_irqsave(&heap_lock);
+    if (align == 1 && (placement_address & 0x00000FFF) )
     {
         // Align the placement address;
         placement_address &= 0xFFFFF000;
@@ -23,13 +271,52 @@ u32int kmalloc_int(u32int sz, int align, u32int *phys)
     }
     if (phys)
     {
-        *phys = placement_address;
+        *phys = VIRT_TO_PHYS(placement_address);
     }
-    u32int tmp = placement_address;
+    tmp = placement_address;
     placement_address += sz;
+    ticket_unlock_irqrestore(&heap_lock, flags);
     return tmp;
 }
 
+void kfree(void *p)
+{
+    u32int addr = (u32int)p, flags;
+    if (!heap_ready || addr < KHEAP_START || addr >= KHEAP_END)
+        return; // Not a heap chunk (e.g. placement memory)
+
+    flags = ticket_lock_irqsave(&heap_lock);
+    if (addr & 0xFFF)
+        slab_free(p);
+    else if (heap_run[(addr - KHEAP_START) / 0x1000] && addr >= KHEAP_START + heap_meta_pages*0x1000)
+        free_heap_pages(addr);
+    ticket_unlock_irqrestore(&heap_lock, flags);
+}
+
+void init_kheap()
+{
+    u32int i;
+
+    // The bookkeeping pages are demand paged and come up zeroed
+    heap_meta_pages = (KHEAP_META_SIZE + 0xFFF) / 0x1000;
+
+    heap_run = (u16int*)KHEAP_START;
+    heap_map = (u32int*)(KHEAP_START + HEAP_PAGES*sizeof(u16int));
+    for (i = 0; i < heap_meta_pages; ++i)
+        heap_map[i/32] |= 0x1 << (i%32);
+    heap_run[0] = heap_meta_pages;
+    heap_hint = 0;
+
+    for (i = 0; i < SLAB_NCLASSES; ++i)
+    {
+        caches[i].size = 0x1 << (i + SLAB_MIN_SHIFT);
+        caches[i].partial = 0;
+        caches[i].nempty = 0;
+    }
+
+    heap_ready = 1;
+}
+
 u32int kmalloc_a(u32int sz)
 {
     return kmalloc_int(sz, 1, 0);
@@ -8,6 +8,23 @@
 
 #include "common.h"
 
+// Virtual address range reserved for the kernel heap: everything from
+// KHEAP_START up to the fixed mappings (KERNEL_FIXMAP in paging.h).
+// Kernel page tables are reached through the recursive directory
+// entry, so the heap can grow without allocating from itself.
+#define KHEAP_START		0xD0000000
+#define KHEAP_END		0xFF800000
+
+// The heap's own bookkeeping at KHEAP_START: a u16 run length and a
+// bit per heap page. initialise_paging() reserves it as a demand
+// paged area, so only the parts in use ever get frames.
+#define KHEAP_META_SIZE	(((KHEAP_END - KHEAP_START) / 0x1000) * 2 + \
+						 ((KHEAP_END - KHEAP_START) / 0x1000) / 8)
+
+// Objects up to this size are served from the slab caches, anything
+// bigger (and every page-aligned request) gets its own pages.
+#define KHEAP_SLAB_MAX	1024
+
 /**
    Allocate a chunk of memory, sz in size. If align == 1,
    the chunk must be page-aligned. If phys != 0, the physical
@@ -28,12 +45,15 @@ u32int kmalloc_a(u32int sz);
 /**
    Allocate a chunk of memory, sz in size. The physical address
    is returned in phys. Phys MUST be a valid pointer to u32int!
+   Once the heap is up, sz may not exceed a page: the frames of
+   larger chunks are not contiguous, so 0 is returned.
 **/
 u32int kmalloc_p(u32int sz, u32int *phys);
 
 /**
    Allocate a chunk of memory, sz in size. The physical address 
-   is returned in phys. It must be page-aligned.
+   is returned in phys. It must be page-aligned. The same one page
+   limit as for kmalloc_p applies.
 **/
 u32int kmalloc_ap(u32int sz, u32int *phys);
 
@@ -42,4 +62,16 @@ u32int kmalloc_ap(u32int sz, u32int *phys);
 **/
 u32int kmalloc(u32int sz);
 
+/**
+   Release a chunk allocated with kmalloc*() once the heap is up.
+   Memory handed out by the placement allocator is never freed.
+**/
+void kfree(void *p);
+
+/**
+   Switch kmalloc*() from the placement allocator over to the heap.
+   Must be called once paging is enabled.
+**/
+void init_kheap();
+
 #endif // KHEAP_H
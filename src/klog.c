@@ -0,0 +1,113 @@
+// klog.c -- In-memory kernel log ring
+
+#include "klog.h"
+#include "kprintf.h"
+#include "console.h"
+#include "clock.h"
+
+static klog_rec_t ring[KLOG_RECORDS];
+static volatile u32int klog_head = 0;	// Номер следующей записи
+static u32int klog_tail = 0;			// Номер первой невыведенной
+// klog_tail меняет только тот, кто взял этот флаг. Вывод может прервать
+// отложенная работа, которая тоже выводит, поэтому флаг не ждут
+static volatile u32int draining = 0;
+
+u32int klog_lost = 0;
+
+void klog_write(const char *fmt, u32int a0, u32int a1, u32int a2, ...)
+{
+	u32int seq = __sync_fetch_and_add(&klog_head, 1);
+	klog_rec_t *rec = &ring[seq & (KLOG_RECORDS - 1)];
+
+	// Пока запись заполняется, читатель не должен ее брать
+	rec->seq = 0;
+	__asm__ volatile ("" : : : "memory");
+	rec->fmt = fmt;
+	rec->args[0] = a0;
+	rec->args[1] = a1;
+	rec->args[2] = a2;
+	rec->tsc = rdtsc();
+	__asm__ volatile ("" : : : "memory");
+	rec->seq = seq + 1;
+}
+
+// Копирует запись seq, если она заполнена и еще не затерта
+static int read_rec(u32int seq, klog_rec_t *copy)
+{
+	klog_rec_t *rec = &ring[seq & (KLOG_RECORDS - 1)];
+	if (rec->seq != seq + 1)
+		return 0;
+	copy->fmt = rec->fmt;
+	copy->args[0] = rec->args[0];
+	copy->args[1] = rec->args[1];
+	copy->args[2] = rec->args[2];
+	copy->tsc = rec->tsc;
+	__asm__ volatile ("" : : : "memory");
+	// Писатель мог затереть запись, пока мы ее копировали
+	return rec->seq == seq + 1;
+}
+
+static void print_rec(klog_rec_t *rec)
+{
+	char buf[KPRINTF_BUF];
+	u32int n;
+
+	u64int us = clock_tsc_to_ns(rec->tsc);
+	u32int rem;
+
+	div64_32(&us, 1000);
+	rem = div64_32(&us, 1000000);
+	n = ksnprintf(buf, sizeof(buf), "[%5u.%06u] ", (u32int)us, rem);
+	n += ksnprintf(buf + n, sizeof(buf) - n, rec->fmt,
+		rec->args[0], rec->args[1], rec->args[2]);
+	console_write(buf, n);
+}
+
+void klog_drain()
+{
+	klog_rec_t rec;
+	u32int head;
+
+	if (__sync_lock_test_and_set(&draining, 1))
+		return;
+	// head читаем только под флагом: иначе другой выводящий мог уже
+	// увести klog_tail дальше него
+	head = klog_head;
+
+	// Записи старше последних KLOG_RECORDS уже затерты
+	if (head - klog_tail > KLOG_RECORDS)
+	{
+		klog_lost += head - klog_tail - KLOG_RECORDS;
+		klog_tail = head - KLOG_RECORDS;
+	}
+	for (; klog_tail != head; ++klog_tail)
+	{
+		if (read_rec(klog_tail, &rec))
+			print_rec(&rec);
+		else if (ring[klog_tail & (KLOG_RECORDS - 1)].seq == 0)
+			break;	// Запись еще заполняется - выведем ее в следующий раз
+		else
+			klog_lost++;
+	}
+	__sync_lock_release(&draining);
+}
+
+void klog_dump()
+{
+	klog_rec_t rec;
+	u32int head = klog_head;
+	u32int seq = head > KLOG_RECORDS ? head - KLOG_RECORDS : 0;
+
+	kprintf("--- last %u log records ---\n", head - seq);
+	for (; seq != head; ++seq)
+		if (read_rec(seq, &rec))
+			print_rec(&rec);
+	// Флаг может держать прерванный нами klog_drain() - тогда
+	// выведенное он напечатает еще раз, но klog_tail не трогаем
+	if (!__sync_lock_test_and_set(&draining, 1))
+	{
+		if ((s32int)(head - klog_tail) > 0)
+			klog_tail = head;
+		__sync_lock_release(&draining);
+	}
+}
@@ -0,0 +1,46 @@
+// klog.h -- In-memory kernel log ring
+
+#ifndef KLOG_H_
+#define KLOG_H_
+
+#include "common.h"
+
+// Число записей в кольце, степень двойки. При переполнении
+// новые записи затирают самые старые
+#define KLOG_RECORDS	256
+#define KLOG_ARGS		3
+
+typedef struct klog_rec
+{
+	volatile u32int seq;	// Номер записи + 1; 0 - запись еще не заполнена
+	const char *fmt;
+	u32int args[KLOG_ARGS];
+	u64int tsc;
+} klog_rec_t;
+
+/**
+ * Добавляет запись в кольцо. Можно вызывать из обработчиков
+ * прерываний: блокировок нет, место под запись резервируется
+ * одной атомарной операцией. Текст не форматируется, сохраняются
+ * только fmt и до KLOG_ARGS 32-битных аргументов, поэтому fmt
+ * и строки для %s должны жить вечно (литералы).
+ */
+#define klog(...) klog_write(__VA_ARGS__, 0, 0, 0)
+extern void klog_write(const char *fmt, u32int a0, u32int a1, u32int a2, ...);
+
+/**
+ * Форматирует еще не выведенные записи и отправляет их в консоль.
+ * Метка времени - секунды с момента init_clock().
+ */
+extern void klog_drain();
+
+/**
+ * Выводит последние записи кольца, выведенные и нет, - для
+ * диагностики перед остановом
+ */
+extern void klog_dump();
+
+// Число записей, затертых до того, как их успели вывести
+extern u32int klog_lost;
+
+#endif
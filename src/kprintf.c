@@ -0,0 +1,167 @@
+// kprintf.c -- Formatted output for the kernel
+
+#include "kprintf.h"
+#include "console.h"
+
+// Буфер назначения: лишние символы считаются, но не записываются
+typedef struct out
+{
+	char *buf;
+	u32int pos;
+	u32int size;	// Без места под завершающий ноль
+} out_t;
+
+static inline void out_char(out_t *out, char c)
+{
+	if (out->pos < out->size)
+		out->buf[out->pos] = c;
+	out->pos++;
+}
+
+static void out_pad(out_t *out, char c, s32int n)
+{
+	for (; n > 0; --n)
+		out_char(out, c);
+}
+
+// Выводит str длиной len в поле width
+static void out_field(out_t *out, const char *str, u32int len, u32int width, int left, char pad)
+{
+	s32int fill = (s32int)width - (s32int)len;
+	// Знак идет перед нулями: -0042, а не 00-42
+	if (pad == '0' && len && *str == '-')
+	{
+		out_char(out, *str++);
+		--len;
+	}
+	if (!left)
+		out_pad(out, pad, fill);
+	while (len--)
+		out_char(out, *str++);
+	if (left)
+		out_pad(out, ' ', fill);
+}
+
+// Пишет цифры n в буфер, заканчивающийся в end,
+// и возвращает указатель на первую
+static char *format_num(char *end, u32int n, u32int base)
+{
+	char *p = end;
+	do
+	{
+		u32int d = n % base;
+		*--p = (d < 10) ? '0' + d : 'a' + d - 10;
+		n /= base;
+	} while (n);
+	return p;
+}
+
+u32int kvsnprintf(char *buf, u32int size, const char *fmt, va_list ap)
+{
+	out_t out = { buf, 0, size ? size - 1 : 0 };
+	char tmp[12];
+	char *end = tmp + sizeof(tmp);
+
+	for (; *fmt; ++fmt)
+	{
+		const char *str;
+		u32int width = 0;
+		int left = 0;
+		char pad = ' ';
+
+		if (*fmt != '%')
+		{
+			out_char(&out, *fmt);
+			continue;
+		}
+
+		// Флаги и ширина поля
+		for (++fmt; *fmt == '-' || *fmt == '0'; ++fmt)
+		{
+			if (*fmt == '-')
+				left = 1;
+			else
+				pad = '0';
+		}
+		for (; *fmt >= '0' && *fmt <= '9'; ++fmt)
+			width = width*10 + *fmt - '0';
+		if (left)
+			pad = ' ';
+
+		switch (*fmt)
+		{
+		case 'd':
+		{
+			s32int v = va_arg(ap, s32int);
+			// -v переполняется для INT_MIN, а беззнаковое - нет
+			char *p = format_num(end, v < 0 ? -(u32int)v : (u32int)v, 10);
+			if (v < 0)
+				*--p = '-';
+			out_field(&out, p, end - p, width, left, pad);
+			break;
+		}
+		case 'u':
+			str = format_num(end, va_arg(ap, u32int), 10);
+			out_field(&out, str, end - str, width, left, pad);
+			break;
+		case 'x':
+			str = format_num(end, va_arg(ap, u32int), 16);
+			out_field(&out, str, end - str, width, left, pad);
+			break;
+		case 'p':
+			// Адрес всегда целиком: 0x и 8 цифр
+			out_char(&out, '0');
+			out_char(&out, 'x');
+			str = format_num(end, (u32int)va_arg(ap, void*), 16);
+			out_field(&out, str, end - str, 8, 0, '0');
+			break;
+		case 's':
+			str = va_arg(ap, const char*);
+			if (!str)
+				str = "(null)";
+			out_field(&out, str, strlen(str), width, left, ' ');
+			break;
+		case 'c':
+			tmp[0] = (char)va_arg(ap, int);
+			out_field(&out, tmp, 1, width, left, ' ');
+			break;
+		case '%':
+			out_char(&out, '%');
+			break;
+		case '\0':
+			--fmt; // Строка кончилась на '%'
+			break;
+		default:
+			// Неизвестный спецификатор выводим как есть
+			out_char(&out, '%');
+			out_char(&out, *fmt);
+			break;
+		}
+	}
+
+	if (size)
+		buf[out.pos < out.size ? out.pos : out.size] = '\0';
+	return out.pos < out.size ? out.pos : out.size;
+}
+
+u32int ksnprintf(char *buf, u32int size, const char *fmt, ...)
+{
+	va_list ap;
+	u32int n;
+	va_start(ap, fmt);
+	n = kvsnprintf(buf, size, fmt, ap);
+	va_end(ap);
+	return n;
+}
+
+u32int kprintf(const char *fmt, ...)
+{
+	char buf[KPRINTF_BUF];
+	va_list ap;
+	u32int n;
+	va_start(ap, fmt);
+	n = kvsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	console_write(buf, n);
+	return n;
+}
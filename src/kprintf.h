@@ -0,0 +1,32 @@
+// kprintf.h -- Formatted output for the kernel
+
+#ifndef KPRINTF_H_
+#define KPRINTF_H_
+
+#include "common.h"
+
+typedef __builtin_va_list va_list;
+#define va_start(ap, last)	__builtin_va_start(ap, last)
+#define va_arg(ap, type)	__builtin_va_arg(ap, type)
+#define va_end(ap)			__builtin_va_end(ap)
+
+// Длиннее kprintf() за один вызов не выводит, остаток отбрасывается
+#define KPRINTF_BUF 256
+
+/**
+ * Форматирует строку в buf размером size, всегда завершая ее нулем.
+ * Поддерживаются %d %u %x %p %s %c и %%, ширина поля и флаги
+ * '-' (выравнивание влево) и '0' (дополнение нулями).
+ * Возвращает число записанных символов без завершающего нуля.
+ */
+extern u32int kvsnprintf(char *buf, u32int size, const char *fmt, va_list ap);
+
+extern u32int ksnprintf(char *buf, u32int size, const char *fmt, ...);
+
+/**
+ * Форматирует строку в буфер на стеке и одним вызовом
+ * передает ее всем backend'ам консоли
+ */
+extern u32int kprintf(const char *fmt, ...);
+
+#endif
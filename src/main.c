@@ -1,27 +1,74 @@
 // main.c -- Defines the C-code kernel entry point, calls initialisation routines.
 
 #include "monitor.h"
+#include "kprintf.h"
 #include "descriptor_tables.h"
 #include "paging.h"
+#include "bench.h"
+#include "multiboot.h"
+#include "serial.h"
+#include "klog.h"
+#include "apic.h"
+#include "clock.h"
+#include "timer.h"
+#include "task.h"
+#include "smp.h"
 
-void kmain(int magic, struct multiboot *mboot_ptr)
+void kmain(int magic, multiboot_t *mboot_ptr)
 {
 	if(magic != 0x2BADB002)
 	{
 		// error. Bootloader not multiboot-compliant
 		return;
 	}
+	// Загрузчик передает физический адрес
+	mboot_ptr = (multiboot_t*)PHYS_TO_VIRT(mboot_ptr);
 	monitor_clear();
 	// All our initialisation calls will go in here
 	// Setting up GDT and IDT
 	init_descriptor_tables();
+	// Копия всего вывода на COM1 (qemu -serial stdio)
+	init_serial();
 	// Allow IRQs
 	__asm__ volatile ("sti");
+	// memset и memcpy используют SSE, если он включен
+	init_fpu();
+	// Частота TSC для clock_ns()
+	init_clock();
 
-	initialise_paging();
-	monitor_write("Hello, paging world!\n");
+#ifdef BENCH
+	bench_frames();
+#endif
 
-	u32int *ptr = (u32int*)0xA0000000;
-	u32int do_page_fault = *ptr;
+	initialise_paging(mboot_ptr);
+	// Если есть IOAPIC, 8259 больше не используется
+	init_apic();
+	init_timer(TIMER_HZ);
+	// kmain становится первой задачей
+	init_tasking();
+	// Остальные процессоры
+	init_smp();
+#ifdef BENCH
+	bench_clone();
+	bench_tlb();
+	bench_mem();
+	bench_console();
+	bench_irq_latency();
+	bench_timers();
+	bench_yield();
+	bench_fork_join();
+	bench_locks();
+	bench_wakeup();
+	dump_interrupt_stats();
+#endif
+#ifdef LOCK_STATS
+	dump_lock_stats();
+#endif
+	klog_drain();
+	kprintf("Hello, paging world!\n");
+
+	// Дальше работают только другие задачи. Когда их нет, процессоры
+	// стоят в hlt в задаче idle, а не крутятся в цикле
+	task_exit();
 }
 
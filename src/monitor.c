@@ -1,17 +1,61 @@
 // monitor.c -- Defines the interface for monitor
 
 #include "monitor.h"
+#include "spinlock.h"
 
-static u16int* video_memory = (u16int*)0xB8000;
+static u16int* video_memory = (u16int*)PHYS_TO_VIRT(0xB8000);
+
+#define COLS 80
+#define ROWS 25
+
+// Цвет символа - белый(15), цвет фона - черный(0)
+#define ATTRIBUTE	(((0 << 4) | (15 & 0x0F)) << 8)
+#define BLANK		(0x20 /*space*/ | ATTRIBUTE)
+
+// Теневой буфер экрана в обычной памяти. Строки в нем образуют
+// кольцо: экранная строка y хранится в строке (top + y) % ROWS,
+// поэтому прокрутка лишь сдвигает top и очищает одну строку.
+// Видеопамять не кэшируется, в нее пишем только изменившиеся
+// строки и только в monitor_flush().
+static u16int shadow[ROWS*COLS];
+static u32int top = 0;
+static u32int dirty = 0;		// Бит y - экранная строка y изменилась
 
 static u8int cursor_x = 0;
 static u8int cursor_y = 0;
+static u16int hw_cursor = 0xFFFF;	// Позиция, выставленная в контроллере
+
+// Все состояние выше и видеопамять. Печатают и из прерываний
+// (kprintf в обработчиках), поэтому только с запретом прерываний
+static spinlock_t monitor_lock = SPINLOCK_INIT("monitor");
+
+#define ALL_ROWS ((0x1 << ROWS) - 1)
+
+static u16int *shadow_row(u32int y)
+{
+	y += top;
+	if (y >= ROWS)
+		y -= ROWS;
+	return shadow + y*COLS;
+}
+
+// Заполняет строку теневого буфера пробелами
+static void clear_row(u16int *row)
+{
+	u32int *p = (u32int*)row;
+	int i;
+	for (i = 0; i < COLS/2; ++i)
+		p[i] = BLANK | (BLANK << 16);
+}
 
 // Обновляет позицию курсора
 static void move_cursor()
 {
 	// Ширина экрана 80 символов...
-	u16int cursorLocation = cursor_y*80 + cursor_x;
+	u16int cursorLocation = cursor_y*COLS + cursor_x;
+	if (cursorLocation == hw_cursor)
+		return;
+	hw_cursor = cursorLocation;
 	outb(0x3D4, 14);					// Мы собираемся послать старший байт координаты курсора...
 	outb(0x3D5, cursorLocation >> 8);	// ... и посылаем его.
 	outb(0x3D4, 15);					// Мы собираемся послать младший байт координаты курсора...
@@ -21,42 +65,23 @@ static void move_cursor()
 // Функцию для прокрутки экрана
 static void scroll()
 {
-	// Создаем пробельный символ с установками цвета по умолчанию
-	u8int attributeByte = (0 /*black*/ << 4) | (15 /*white*/ & 0x0F);
-	u16int blank = 0x20 /*space*/ | (attributeByte << 8);
-
 	// 25 строка - последняя. Это значит, что мы должны прокрутить экран.
-	if(cursor_y >= 25)
+	if(cursor_y >= ROWS)
 	{
-		// Копируем i строку в i-1
-		int i;
-		for (i = 0;i < 24*80; ++i)
-		{
-			video_memory[i] = video_memory[i+80];
-		}
-
-		// Последняя строка должна быть пустой
-		for(i = 24*80; i < 25*80;++i)
-		{
-			video_memory[i] = blank;
-		}
+		// Бывшая верхняя строка становится последней и должна быть пустой
+		clear_row(shadow_row(0));
+		if (++top == ROWS)
+			top = 0;
+		// Сдвинулся весь экран
+		dirty = ALL_ROWS;
 		// Курсор должне быть на последней строке
-		cursor_y = 24;
+		cursor_y = ROWS - 1;
 	}
 }
 
-// Выводим символ на экран
-void monitor_put(char c)
+// Выводит символ в теневой буфер
+static void put_char(char c)
 {
-	// Цвет символа - белый(15), цвет фона - черный(0)
-	u8int backColor = 0;
-	u8int foreColor = 15;
-
-	u8int attributeByte = (backColor << 4) | (foreColor & 0x0F);
-	
-	u16int attribute = attributeByte << 8;
-	u16int *location;
-
 	if(c == 0x08 && cursor_x) // <BackSpace>
 		--cursor_x;
 	else if(c == 0x09) // <TAB>
@@ -70,106 +95,89 @@ void monitor_put(char c)
 	}
 	else if(c >= ' ')
 	{
-		location = video_memory + (cursor_y*80 + cursor_x);
-		*location = c | attribute;
+		shadow_row(cursor_y)[cursor_x] = c | ATTRIBUTE;
+		dirty |= 0x1 << cursor_y;
 		++cursor_x;
 	}
 
-	if(cursor_x >= 80)
+	if(cursor_x >= COLS)
 	{
 		cursor_x = 0;
 		++cursor_y;
 	}
 
 	scroll();
-	move_cursor();
 }
 
-void monitor_clear()
+static void flush()
 {
-	// Создаем пробельный символ с установками цвета по умолчанию
-	u8int attributeByte = (0 /*black*/ << 4) | (15 /*white*/ & 0x0F);
-	u16int blank = 0x20 /*space*/ | (attributeByte << 8);
-
-	int i;
-	for(i=0;i<80*25;++i)
+	u32int y;
+	if (dirty == ALL_ROWS)
 	{
-		video_memory[i] = blank;
+		// Кольцо целиком: две части, каждая одним копированием
+		memcpy(video_memory, shadow_row(0), (ROWS - top)*COLS*2);
+		memcpy(video_memory + (ROWS - top)*COLS, shadow, top*COLS*2);
 	}
-
-	cursor_x = 0;
-	cursor_y = 0;
+	else
+	{
+		while (dirty)
+		{
+			y = bsf(dirty);
+			memcpy(video_memory + y*COLS, shadow_row(y), COLS*2);
+			dirty &= dirty - 1;
+		}
+	}
+	dirty = 0;
 	move_cursor();
 }
 
-// Выводит нуль-терминированную строку на экран
-void monitor_write(char* c)
+void monitor_flush()
 {
-	int i = 0;
-	while(c[i])
-		monitor_put(c[i++]);
+	u32int flags = spin_lock_irqsave(&monitor_lock);
+	flush();
+	spin_unlock_irqrestore(&monitor_lock, flags);
 }
 
-void monitor_write_hex(u32int n)
+// Выводим символ на экран
+void monitor_put(char c)
 {
-	s32int tmp;
-	monitor_write("0x");
-
-	char noZeroes = 1;
-
-	int i;
-	for(i = 28; i > 0; i -= 4)
-	{
-		tmp = (n>>i) & 0xF;
-		if(tmp == 0 && noZeroes != 0)
-		{
-			continue;
-		}
+	u32int flags = spin_lock_irqsave(&monitor_lock);
+	put_char(c);
+	flush();
+	spin_unlock_irqrestore(&monitor_lock, flags);
+}
 
-		if(tmp >= 0xA)
-		{
-			noZeroes = 0;
-			monitor_put(tmp - 0xA+'a');
-		}
-		else
-		{
-			noZeroes = 0;
-			monitor_put(tmp+'0');
-		}
-	}
+void monitor_clear()
+{
+	u32int y, flags = spin_lock_irqsave(&monitor_lock);
+	for (y = 0; y < ROWS; ++y)
+		clear_row(shadow + y*COLS);
+	top = 0;
+	dirty = ALL_ROWS;
 
-	tmp = n & 0xF;
-	if( tmp >= 0xA )
-		monitor_put(tmp-0xA+'a');
-	else
-		monitor_put(tmp+'0');
+	cursor_x = 0;
+	cursor_y = 0;
+	flush();
+	spin_unlock_irqrestore(&monitor_lock, flags);
 }
 
-void monitor_write_dec(u32int n)
+// Выводит нуль-терминированную строку на экран. Видеопамять
+// и курсор обновляются один раз, после всей строки
+void monitor_write(char* c)
 {
-	if(n==0)
-	{
-		monitor_put('0');
-		return;
-	}
-
-	s32int acc = n;
-	char c[32];
 	int i = 0;
-	while(acc > 0)
-	{
-		c[i] = '0' + acc%10;
-		acc /= 10;
-		++i;
-	}
-	c[i] = 0;
-
-	char c2[32];
-	c2[i--] = 0;
-	int j = 0;
-	while(i >= 0)
-		c2[i--] = c[j++];
-	
-	monitor_write(c2);
+	u32int flags = spin_lock_irqsave(&monitor_lock);
+	while(c[i])
+		put_char(c[i++]);
+	flush();
+	spin_unlock_irqrestore(&monitor_lock, flags);
 }
 
+void monitor_write_buf(const char *buf, u32int len)
+{
+	u32int flags = spin_lock_irqsave(&monitor_lock);
+	while (len--)
+		put_char(*buf++);
+	flush();
+	spin_unlock_irqrestore(&monitor_lock, flags);
+}
@@ -8,15 +8,19 @@
 // Write a single character out to the screen
 extern void monitor_put(char c);
 
+// Copy the changed rows of the shadow buffer to video memory
+// and move the hardware cursor. monitor_put and monitor_write
+// do this themselves.
+extern void monitor_flush();
+
 // Clear the screen to all back
 extern void monitor_clear();
 
 // Output the null-terminated ASCII string to the monitor
 extern void monitor_write(char *c);
 
-extern void monitor_write_hex(u32int n);
-
-extern void monitor_write_dec(u32int n);
+// Output len characters of buf, the console backend for the screen
+extern void monitor_write_buf(const char *buf, u32int len);
 
 #endif
 
@@ -0,0 +1,68 @@
+// multiboot.h -- Declares the information structure passed to the
+//                kernel by a multiboot compliant boot loader
+
+#ifndef MULTIBOOT_H_
+#define MULTIBOOT_H_
+
+#include "common.h"
+
+#define MULTIBOOT_FLAG_MEM		0x001	// Заполнены mem_lower и mem_upper
+#define MULTIBOOT_FLAG_DEVICE	0x002
+#define MULTIBOOT_FLAG_CMDLINE	0x004
+#define MULTIBOOT_FLAG_MODS		0x008
+#define MULTIBOOT_FLAG_AOUT		0x010
+#define MULTIBOOT_FLAG_ELF		0x020
+#define MULTIBOOT_FLAG_MMAP		0x040	// Заполнены mmap_length и mmap_addr
+#define MULTIBOOT_FLAG_CONFIG	0x080
+#define MULTIBOOT_FLAG_LOADER	0x100
+#define MULTIBOOT_FLAG_APM		0x200
+#define MULTIBOOT_FLAG_VBE		0x400
+
+// Тип области памяти, которую можно использовать
+#define MULTIBOOT_MEMORY_AVAILABLE	1
+
+struct multiboot
+{
+	u32int flags;
+	u32int mem_lower;			// Объем памяти ниже 1 МБ, в кБ
+	u32int mem_upper;			// Объем памяти выше 1 МБ, в кБ
+	u32int boot_device;
+	u32int cmdline;
+	u32int mods_count;
+	u32int mods_addr;
+	u32int num;
+	u32int size;
+	u32int addr;
+	u32int shndx;
+	u32int mmap_length;			// Размер карты памяти в байтах
+	u32int mmap_addr;			// Физический адрес карты памяти
+	u32int drives_length;
+	u32int drives_addr;
+	u32int config_table;
+	u32int boot_loader_name;
+	u32int apm_table;
+	u32int vbe_control_info;
+	u32int vbe_mode_info;
+	u32int vbe_mode;
+	u32int vbe_interface_seg;
+	u32int vbe_interface_off;
+	u32int vbe_interface_len;
+} __attribute__((packed));
+
+typedef struct multiboot multiboot_t;
+
+// Запись карты памяти. Поле size не учитывает само себя,
+// следующая запись начинается через size + 4 байт
+struct multiboot_mmap_entry
+{
+	u32int size;
+	u32int base_low;
+	u32int base_high;
+	u32int length_low;
+	u32int length_high;
+	u32int type;
+} __attribute__((packed));
+
+typedef struct multiboot_mmap_entry multiboot_mmap_entry_t;
+
+#endif
@@ -3,45 +3,115 @@
 
 #include "paging.h"
 #include "kheap.h"
-#include "monitor.h"
-
-#define PANIC(a) while(1);
+#include "kprintf.h"
+#include "klog.h"
+#include "buddy.h"
+#include "smp.h"
+#include "multiboot.h"
 
 // The kernel's page directory
 page_directory_t *kernel_directory=0;
 
-// The current page directory
-page_directory_t *current_directory=0;
+// The directory loaded on this CPU is kept in its cpu_t (%gs:16),
+// see get_current_directory()
+static inline void set_current_directory(page_directory_t *dir)
+{
+	__asm__ volatile ("mov %0, %%gs:16" : : "r"(dir) : "memory");
+}
+
+// PAGING_* features in use
+u32int paging_flags = 0;
+
+// Up to this many pages are invalidated one by one with invlpg
+u32int tlb_flush_threshold = 32;
+
+// Page fault statistics
+vm_stats_t vm_stats;
+
+// Bumped whenever a page table or a directory is freed. The per-CPU
+// get_page() cache (cpu_t.walk_*) is only trusted for the generation
+// it was filled in, so no CPU reaches a freed table through it.
+static volatile u32int table_gen = 0;
+
+// For every frame, how many more page tables map it besides the one
+// that allocated it. A frame is returned to the bitset only when the
+// last mapping goes away.
+static u8int *frame_shares;
+
+// Set once paging runs on kernel_directory: from then on new kernel
+// page tables are reached through the recursive directory entry
+static int recursive_ready = 0;
 
 // A bitset of freames - used or free
 u32int *frames;
 u32int nframes;
 
+// Two summary levels over the frames bitset. A bit in frames_full is
+// set when the corresponding word of frames has no free frame left,
+// a bit in frames_full2 - when the word of frames_full is all ones.
+// For 4 GB of memory frames_full2 is only 32 words long, so the
+// search for a free frame is a short scan plus three bit scans.
+static u32int *frames_full;
+static u32int *frames_full2;
+static u32int nframe_words;		// Length of frames in words
+static u32int nframe_words1;	// Length of frames_full in words
+static u32int nframe_words2;	// Length of frames_full2 in words
+
+// Number of free frames
+u32int nfree_frames;
+
+// Guards frames, its summaries, the buddy maps and frame_shares.
+// Frames are freed from under heap_lock with interrupts off, so it
+// is always taken with spin_lock_irqsave(), and never while calling
+// back into the heap.
+spinlock_t frames_lock = SPINLOCK_INIT("frames");
+
 // Defined in kheap.c
 extern u32int placement_address;
 
 // Macros used in the bitset algorithms
 #define INDEX_FROM_BIT(a) (a/(8*4))
 #define OFFSET_FROM_BIT(a) (a%(8*4))
+#define WORDS_FOR_BITS(a) (((a)+31)/32)
 
-// Static function to set a bit int the frames bitset
-static void set_frame(u32int frame_addr)
+// Function to set a bit int the frames bitset
+void set_frame(u32int frame_addr)
 {
 	u32int frame = frame_addr/0x1000;
 	u32int idx = INDEX_FROM_BIT(frame);
 	u32int off = OFFSET_FROM_BIT(frame);
+	if (frames[idx] & (0x1 << off))
+		return;
 	frames[idx] |= (0x1 << off);
+	--nfree_frames;
+	buddy_frame_used(frame);
+	if (frames[idx] == 0xFFFFFFFF)
+	{
+		// Слово заполнено - отмечаем это в сводках
+		frames_full[INDEX_FROM_BIT(idx)] |= 0x1 << OFFSET_FROM_BIT(idx);
+		idx = INDEX_FROM_BIT(idx);
+		if (frames_full[idx] == 0xFFFFFFFF)
+			frames_full2[INDEX_FROM_BIT(idx)] |= 0x1 << OFFSET_FROM_BIT(idx);
+	}
 }
 
-static void clear_frame(u32int frame_addr)
+void clear_frame(u32int frame_addr)
 {
 	u32int frame = frame_addr/0x1000;
 	u32int idx = INDEX_FROM_BIT(frame);
 	u32int off = OFFSET_FROM_BIT(frame);
+	if (!(frames[idx] & (0x1 << off)))
+		return;
 	frames[idx] &= ~(0x1 << off);
+	++nfree_frames;
+	buddy_frame_freed(frame);
+	// Слово заведомо больше не заполнено, как и слова сводок над ним
+	frames_full[INDEX_FROM_BIT(idx)] &= ~(0x1 << OFFSET_FROM_BIT(idx));
+	idx = INDEX_FROM_BIT(idx);
+	frames_full2[INDEX_FROM_BIT(idx)] &= ~(0x1 << OFFSET_FROM_BIT(idx));
 }
 
-static u32int test_frame(u32int frame_addr)
+u32int test_frame(u32int frame_addr)
 {
 	u32int frame = frame_addr/0x1000;
 	u32int idx = INDEX_FROM_BIT(frame);
@@ -49,19 +119,68 @@ static u32int test_frame(u32int frame_addr)
 	return (frames[idx] & (0x1 << off));
 }
 
+// Returns the index of a free frame or -1 if there is none
 static u32int first_frame()
 {
-	u32int i, j;
-	for (i = 0; i < INDEX_FROM_BIT(nframes); ++i)
+	u32int i;
+	for (i = 0; i < nframe_words2; ++i)
 	{
-		if (frames[i] != 0xFFFFFFFF) // nothing free, exit early
-			for (j = 0; j < 32; ++j)
-			{
-				u32int toTest = 0x1 << j;
-				if(!(frames[i]&toTest))
-					return i*4*8+j;
-			}
+		if (frames_full2[i] != 0xFFFFFFFF)
+		{
+			u32int w1 = i*32 + bsf(~frames_full2[i]);
+			u32int w = w1*32 + bsf(~frames_full[w1]);
+			return w*32 + bsf(~frames[w]);
+		}
 	}
+	return (u32int)-1;
+}
+
+// Creates the bitset for n frames with every frame marked used.
+// Callers free the frames they know to be usable RAM.
+void init_frames(u32int n)
+{
+	nframes = n;
+	nframe_words = WORDS_FOR_BITS(nframes);
+	nframe_words1 = WORDS_FOR_BITS(nframe_words);
+	nframe_words2 = WORDS_FOR_BITS(nframe_words1);
+
+	frames = (u32int*)kmalloc(nframe_words*4);
+	frames_full = (u32int*)kmalloc(nframe_words1*4);
+	frames_full2 = (u32int*)kmalloc(nframe_words2*4);
+	memset(frames, 0xFF, nframe_words*4);
+	memset(frames_full, 0xFF, nframe_words1*4);
+	memset(frames_full2, 0xFF, nframe_words2*4);
+
+	nfree_frames = 0;
+	buddy_init();
+}
+
+u32int frame_alloc()
+{
+	u32int flags = spin_lock_irqsave(&frames_lock);
+	u32int idx = first_frame();
+	if (idx != (u32int)-1)
+		set_frame(idx*0x1000);
+	spin_unlock_irqrestore(&frames_lock, flags);
+	return idx == (u32int)-1 ? idx : idx*0x1000;
+}
+
+void frame_free(u32int frame_addr)
+{
+	u32int flags = spin_lock_irqsave(&frames_lock);
+	clear_frame(frame_addr);
+	spin_unlock_irqrestore(&frames_lock, flags);
+}
+
+// Map the page onto the given frame, which the caller has already
+// claimed in the frames bitset
+static void set_page_frame(page_t *page, u32int frame_addr, int is_kernel, int is_writeable)
+{
+	page->present = 1;
+	page->rw = (is_writeable)?1:0;
+	page->user = (is_kernel)?0:1;
+	page->cow = 0;
+	page->frame = frame_addr / 0x1000;
 }
 
 // Function to allocate frame
@@ -71,15 +190,11 @@ void alloc_frame(page_t *page, int is_kernel, int is_writeable)
 		return; // Кадр уже выделен для данной страницы
 	else
 	{
-		u32int idx = first_frame(); // index of the first frame
+		u32int idx = frame_alloc(); // застолбили кадр
 		if(idx == (u32int)-1)
 			PANIC("No free frames!");
 
-		set_frame(idx*0x1000); // застолбили кадр
-		page->present = 1;
-		page->rw = (is_writeable)?1:0;
-		page->user = (is_kernel)?0:1;
-		page->frame = idx;
+		set_page_frame(page, idx, is_kernel, is_writeable);
 	}
 }
 
@@ -90,104 +205,912 @@ void free_frame(page_t *page)
 		return; // Кадр для данной страницы не выделен
 	else
 	{
-		clear_frame(frame);
+		// Разделяемый кадр освобождает только последний владелец.
+		// Кадры за пределами памяти (MMIO) не учитываются вовсе
+		if (frame < nframes)
+		{
+			u32int flags = spin_lock_irqsave(&frames_lock);
+			if (frame_shares && frame_shares[frame])
+				frame_shares[frame]--;
+			else
+				clear_frame(frame*0x1000);
+			spin_unlock_irqrestore(&frames_lock, flags);
+		}
+		page->present = 0;
+		page->cow = 0;
 		page->frame = 0x0;
 	}
 }
 
-void initialise_paging()
+// Checks for 4 MB and global page support and turns them on in CR4
+static void detect_paging_features()
 {
-	// Пусть размер нашей памяти - 16 МБ
-	// пока что
-	u32int mem_end_page = 0x1000000;
+	u32int eax, ebx, ecx, edx, cr4;
+	cpuid(1, &eax, &ebx, &ecx, &edx);
 
-	nframes = mem_end_page / 0x1000;
-	frames = (u32int*)kmalloc(INDEX_FROM_BIT(nframes));
-	memset(frames, 0, INDEX_FROM_BIT(nframes));
+	__asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+	if (edx & (0x1 << 3))
+	{
+		paging_flags |= PAGING_PSE;
+		cr4 |= 0x10;	// CR4.PSE
+	}
+	if (edx & (0x1 << 13))
+	{
+		paging_flags |= PAGING_PGE;
+		cr4 |= 0x80;	// CR4.PGE
+	}
+	__asm__ volatile ("mov %0, %%cr4" : : "r"(cr4));
+}
+
+// Блокировка каталога обнуляется вместе с ним. Каталоги освобождаются,
+// а список блокировок dump_lock_stats() только растет, поэтому в него
+// она не попадает
+static void init_dir_lock(page_directory_t *dir)
+{
+#ifdef LOCK_STATS
+	dir->lock.stats.name = "vma";
+	dir->lock.stats.registered = 1;
+#endif
+}
 
-	// Создаем каталог страниц
+// Calls fn for every usable RAM range below 4 GB reported by the
+// boot loader. Ranges are given in frames: [first, end).
+static void for_each_ram_range(multiboot_t *mboot, void (*fn)(u32int, u32int))
+{
+	if (mboot->flags & MULTIBOOT_FLAG_MMAP)
+	{
+		// Карта лежит в нижней памяти, а та видна только через окно ядра
+		u32int addr = PHYS_TO_VIRT(mboot->mmap_addr);
+		u32int end_addr = addr + mboot->mmap_length;
+		while (addr < end_addr)
+		{
+			multiboot_mmap_entry_t *e = (multiboot_mmap_entry_t*)addr;
+			addr += e->size + 4;
+			if (e->type != MULTIBOOT_MEMORY_AVAILABLE || e->base_high)
+				continue;
+
+			u64int base = e->base_low;
+			u64int end = base + (((u64int)e->length_high << 32) | e->length_low);
+			if (end > 0x100000000ULL)
+				end = 0x100000000ULL;
+			// Неполные кадры на краях области не используем
+			fn((u32int)((base + 0xFFF) >> 12), (u32int)(end >> 12));
+		}
+	}
+	else if (mboot->flags & MULTIBOOT_FLAG_MEM)
+	{
+		// Карты нет - только размеры памяти до и после 1 МБ
+		fn(0, mboot->mem_lower / 4);
+		fn(0x100, 0x100 + mboot->mem_upper / 4);
+	}
+	else
+	{
+		// Загрузчик ничего не сообщил, считаем что памяти 16 МБ
+		fn(0x100, 0x1000);
+	}
+}
+
+static u32int ram_end_frame;
+
+static void find_ram_end(u32int first, u32int end)
+{
+	if (end > ram_end_frame)
+		ram_end_frame = end;
+}
+
+static void free_ram_range(u32int first, u32int end)
+{
+	for (; first < end; ++first)
+		clear_frame(first*0x1000);
+}
+
+void initialise_paging(multiboot_t *mboot)
+{
+	// Битовая карта кадров покрывает память до конца последней
+	// доступной области. Все кадры изначально заняты, свободными
+	// помечаем только области, которые загрузчик назвал доступными:
+	// дыры, зарезервированные области и таблицы ACPI остаются занятыми.
+	ram_end_frame = 0;
+	for_each_ram_range(mboot, find_ram_end);
+	init_frames(ram_end_frame);
+	for_each_ram_range(mboot, free_ram_range);
+
+	frame_shares = (u8int*)kmalloc(nframes);
+	memset(frame_shares, 0, nframes);
+
+	// Создаем каталог страниц. Последняя его запись указывает на
+	// него самого: так таблицы ядра видны по адресам PT_VIRT(i)
 	kernel_directory = (page_directory_t*)kmalloc_a(sizeof(page_directory_t));
 	memset(kernel_directory, 0, sizeof(page_directory_t));
-	current_directory = kernel_directory;
+	init_dir_lock(kernel_directory);
+	kernel_directory->physicalAddr = VIRT_TO_PHYS(kernel_directory->tablesPhysical);
+	kernel_directory->tablesPhysical[RECURSIVE_TABLE] = kernel_directory->physicalAddr | PDE_RW | PDE_PRESENT;
+	set_current_directory(kernel_directory);
+
+	// Служебные данные кучи заполняются по мере обращения к ним.
+	// Область резервируем заранее, пока работает placement-аллокатор
+	vmm_reserve(kernel_directory, KHEAP_START, KHEAP_META_SIZE, VMA_WRITE);
 
 	/**
-	 * Теперь нам необходимо тождественно отобразить
-	 * адреса виртуальной памяти на адреса физической памяти,
-	 * чтобы мы могли прозрачно обращаться к физической памяти,
-	 * как будто страничная адресация не включена.
-	 * Обратите внимание что мы специально используем здесь
-	 * цикл while, т.к. внутри тела цикла значение переменной
-	 * placement_address изменяется при вызове kmalloc().
+	 * Теперь нам необходимо отобразить физическую память
+	 * от нуля до конца образа ядра и placement-данных на
+	 * адреса начиная с KERNEL_VIRTUAL_BASE, по которым
+	 * ядро слинковано. Тождественного отображения нет:
+	 * нижние 3 ГБ принадлежат пользовательским пространствам.
+	 * Отображение доступно только ядру и помечено глобальным,
+	 * чтобы переживать перезагрузку CR3.
 	 */
-	int i = 0;
-	while (i < placement_address)
+	u32int i;
+	detect_paging_features();
+	if (paging_flags & PAGING_PSE)
 	{
-		// Код ядра доступен для чтения но не для записи
-		// из пространства пользователя
-		alloc_frame( get_page(i, 1, kernel_directory),0,0);
-		i += 0x1000;
+		// Страницы по 4 МБ: таблицы не нужны, и одна запись TLB
+		// покрывает 1024 страницы. Последнюю страницу отображаем
+		// целиком; кадры за placement_address остаются свободными.
+		u32int end = (VIRT_TO_PHYS(placement_address) + 0x3FFFFF) & 0xFFC00000;
+		for (i = 0; i < end; i += 0x400000)
+			kernel_directory->tablesPhysical[KERNEL_TABLE_FIRST + (i >> 22)] =
+				i | PDE_GLOBAL | PDE_4MB | PDE_RW | PDE_PRESENT;
 	}
-	// Прежде чем мы включим страничную адресацию, мы должны
+	else
+	{
+		// Сначала создаем все таблицы: каждая из них увеличивает
+		// placement_address, а отобразить нужно и ее саму.
+		// Обратите внимание что мы специально используем здесь
+		// цикл while, т.к. внутри тела цикла значение переменной
+		// placement_address изменяется при вызове kmalloc().
+		u32int end = 0;
+		while (end < placement_address)
+		{
+			end = placement_address;
+			for (i = KERNEL_VIRTUAL_BASE; i < end; i += 0x400000)
+				get_page(i, 1, kernel_directory);
+		}
+		map_range(kernel_directory, KERNEL_VIRTUAL_BASE, 0, VIRT_TO_PHYS(end), PAGE_GLOBAL | PAGE_RW);
+	}
+	// Кадры образа ядра и placement-данных заняты. Нулевой кадр
+	// тоже: frame == 0 в записи означает "кадр не выделен". Кадр
+	// SMP_TRAMPOLINE нужен для запуска AP (smp.c). Остальная
+	// свободная память ниже 1 МБ остается свободной.
+	set_frame(0);
+	set_frame(SMP_TRAMPOLINE);
+	for (i = 0x100000; i < VIRT_TO_PHYS(placement_address); i += 0x1000)
+		set_frame(i);
+
+	// Прежде чем мы переключимся на новый каталог, мы должны
 	// зарегистрировать обработчик page fault
 	register_interrupt_handler(14, page_fault);
 
-	// Теперь ВКЛ.
-	switch_page_directory(kernel_directory);
+	// Страничная адресация уже включена в boot.s, меняем
+	// временный каталог на настоящий
+	__asm__ volatile ("mov %0, %%cr3"::"r"(kernel_directory->physicalAddr));
+	recursive_ready = 1;
+
+	// Дальше kmalloc() работает через кучу
+	init_kheap();
+}
+
+// Flushes the whole TLB. Global entries only go away when CR4.PGE
+// is toggled, a CR3 reload keeps them.
+static void flush_tlb_all(int global)
+{
+	if (global && (paging_flags & PAGING_PGE))
+	{
+		u32int cr4;
+		__asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+		__asm__ volatile ("mov %0, %%cr4" : : "r"(cr4 & ~0x80) : "memory");
+		__asm__ volatile ("mov %0, %%cr4" : : "r"(cr4) : "memory");
+	}
+	else
+		__asm__ volatile ("mov %%cr3, %%eax; mov %%eax, %%cr3" : : : "eax", "memory");
+}
+
+// Shootdown generation. A CPU that flushed its TLB after reading
+// generation g has dropped every entry changed before g was handed out
+#define TLB_FLUSH	0x1
+#define TLB_GLOBAL	0x2
+static volatile u32int tlb_gen = 0;
+
+void tlb_flush_requested()
+{
+	cpu_t *cpu = this_cpu();
+	u32int flags = irq_save(), pending, gen;
+
+	pending = __sync_lock_test_and_set(&cpu->tlb_pending, 0);
+	if (pending)
+	{
+		// Поколение читаем после того, как забрали запрос: запросивший
+		// увеличил его раньше, чем выставил запрос
+		gen = tlb_gen;
+		flush_tlb_all(pending & TLB_GLOBAL);
+		if ((s32int)(gen - cpu->tlb_done) > 0)
+			cpu->tlb_done = gen;
+	}
+	irq_restore(flags);
+}
+
+void tlb_shootdown(int global)
+{
+	u32int flags, self, gen, i;
+
+	if (smp_ncpus == 1)
+		return;
+	// Прерывания выключены, чтобы не сменить процессор. Запросы
+	// к нам самим, пока ждем других, выполняет lock_relax()
+	flags = irq_save();
+	self = smp_processor_id();
+	gen = __sync_add_and_fetch(&tlb_gen, 1);
+	for (i = 0; i < smp_ncpus; ++i)
+	{
+		if (i == self)
+			continue;
+		__sync_fetch_and_or(&cpus[i]->tlb_pending, global ? TLB_FLUSH | TLB_GLOBAL : TLB_FLUSH);
+		apic_send_ipi(cpus[i]->apic_id, IRQ_TLB_SHOOTDOWN);
+	}
+	for (i = 0; i < smp_ncpus; ++i)
+		while (i != self && (s32int)(cpus[i]->tlb_done - gen) < 0)
+			lock_relax();
+	irq_restore(flags);
+}
+
+// Whether a change to the entry for vaddr in dir can be cached in
+// the TLB right now: dir is current or shares that table with it
+static int tlb_visible(page_directory_t *dir, u32int vaddr)
+{
+	u32int idx = vaddr >> 22;
+	// Таблицы ядра общие, а глобальные записи переживают смену CR3
+	return idx >= KERNEL_TABLE_FIRST || dir == current_directory ||
+		(dir->tables[idx] && dir->tables[idx] == current_directory->tables[idx]);
+}
+
+// Collects invalidations for a batch of modified entries. The first
+// tlb_flush_threshold pages are flushed with invlpg as they come, if
+// there are more, tlb_batch_finish() flushes everything at once.
+// Other CPUs may run dir too, so they get one shootdown at the end.
+typedef struct tlb_batch
+{
+	u32int count;
+	int global;
+	int remote;
+} tlb_batch_t;
+
+static void tlb_batch_add(tlb_batch_t *batch, page_directory_t *dir, u32int vaddr, page_t *page)
+{
+	batch->global |= page->global;
+	batch->remote = 1;
+	if (!tlb_visible(dir, vaddr))
+		return;
+	if (++batch->count <= tlb_flush_threshold)
+		invlpg(vaddr);
+}
+
+static void tlb_batch_finish(tlb_batch_t *batch)
+{
+	if (batch->count > tlb_flush_threshold)
+		flush_tlb_all(batch->global);
+	if (batch->remote)
+		tlb_shootdown(batch->global);
+}
+
+void map_page(page_directory_t *dir, u32int vaddr, u32int paddr, u32int flags)
+{
+	page_t *page = get_page(vaddr, 1, dir);
+	u32int was_present, global;
+	if (!page)
+		return; // Внутри 4 МБ страницы
+
+	was_present = page->present;
+	global = page->global;
+	*(u32int*)page = (paddr & 0xFFFFF000) | (flags & 0xFFF) | PAGE_PRESENT;
+	// Отсутствующие страницы в TLB не попадают
+	if (!was_present)
+		return;
+	if (tlb_visible(dir, vaddr))
+		invlpg(vaddr);
+	tlb_shootdown(global);
+}
+
+u32int unmap_page(page_directory_t *dir, u32int vaddr)
+{
+	page_t *page = get_page(vaddr, 0, dir);
+	u32int paddr, global;
+	if (!page || !page->present)
+		return 0;
+
+	paddr = page->frame*0x1000;
+	global = page->global;
+	*(u32int*)page = 0;
+	if (tlb_visible(dir, vaddr))
+		invlpg(vaddr);
+	tlb_shootdown(global);
+	return paddr;
+}
+
+void free_user_table(page_directory_t *dir, u32int vaddr)
+{
+	u32int idx = vaddr >> 22, i;
+	page_table_t *table = dir->tables[idx];
+
+	if (idx >= KERNEL_TABLE_FIRST || !table)
+		return;
+	for (i = 0; i < 1024; ++i)
+		if (table->pages[i].present)
+			return;
+
+	dir->tables[idx] = 0;
+	dir->tablesPhysical[idx] = 0;
+	__sync_fetch_and_add(&table_gen, 1);
+	// Процессоры могли закэшировать саму запись каталога: сбрасываем
+	// TLB целиком, и только потом таблица возвращается в кучу
+	if (current_directory == dir)
+		flush_tlb_all(0);
+	tlb_shootdown(0);
+	kfree(table);
+}
+
+void protect_range(page_directory_t *dir, u32int vaddr, u32int len, u32int flags)
+{
+	tlb_batch_t batch = { 0, 0, 0 };
+	u32int end = vaddr + len;
+
+	for (vaddr &= 0xFFFFF000; vaddr < end; vaddr += 0x1000)
+	{
+		page_t *page = get_page(vaddr, 0, dir);
+		if (!page || !page->present)
+			continue;
+		if (page->rw == !!(flags & PAGE_RW) && page->user == !!(flags & PAGE_USER))
+			continue;
+		page->rw = !!(flags & PAGE_RW);
+		page->user = !!(flags & PAGE_USER);
+		tlb_batch_add(&batch, dir, vaddr, page);
+	}
+	tlb_batch_finish(&batch);
+}
+
+void map_range(page_directory_t *dir, u32int vaddr, u32int paddr, u32int len, u32int flags)
+{
+	tlb_batch_t batch = { 0, 0, 0 };
+	u32int npages = ((vaddr & 0xFFF) + len + 0xFFF) / 0x1000;
+
+	vaddr &= 0xFFFFF000;
+	paddr &= 0xFFFFF000;
+	flags = (flags & 0xFFF) | PAGE_PRESENT;
+
+	while (npages)
+	{
+		// Одна таблица за раз: запрашиваем ее однажды
+		// и заполняем подряд идущие записи
+		page_t *page = get_page(vaddr, 1, dir);
+		u32int n = 1024 - ((vaddr >> 12) & 0x3FF);
+		if (n > npages)
+			n = npages;
+		npages -= n;
+
+		if (!page)
+		{
+			// Внутри 4 МБ страницы - пропускаем ее
+			vaddr += n*0x1000;
+			paddr += n*0x1000;
+			continue;
+		}
+		for (; n; --n, ++page, vaddr += 0x1000, paddr += 0x1000)
+		{
+			if (page->present)
+				tlb_batch_add(&batch, dir, vaddr, page);
+			*(u32int*)page = paddr | flags;
+		}
+	}
+	tlb_batch_finish(&batch);
+}
+
+// Maps the frame into copy window n (0 or 1) of this CPU and returns
+// its address. Only this CPU touches its windows, so a local invlpg
+// is enough; the caller keeps preemption (or interrupts) off while
+// it uses them.
+static void *map_window(u32int n, u32int frame_addr)
+{
+	u32int addr = FIXMAP_ADDR(FIXMAP_COPY + 2*smp_processor_id() + n);
+	page_t *page = get_page(addr, 1, kernel_directory);
+	*(u32int*)page = frame_addr | PAGE_GLOBAL | PAGE_RW | PAGE_PRESENT;
+	invlpg(addr);
+	return (void*)addr;
+}
+
+static u32int copy_frame(u32int src_frame_addr)
+{
+	u32int dst = frame_alloc();
+	if (dst == (u32int)-1)
+		PANIC("No free frames!");
+	preempt_disable();
+	memcpy(map_window(0, dst), map_window(1, src_frame_addr), 0x1000);
+	preempt_enable();
+	return dst;
+}
+
+// Copies the table that maps base in src_dir, sharing its frames
+static page_table_t *clone_table(page_directory_t *src_dir, u32int base, tlb_batch_t *batch, u32int *phys)
+{
+	page_table_t *src = src_dir->tables[base >> 22];
+	page_table_t *table = (page_table_t*)kmalloc_ap(sizeof(page_table_t), phys);
+	int i;
+	if (!table)
+		PANIC("No free frames!");
+	memset(table, 0, sizeof(page_table_t));
+
+	for (i = 0; i < 1024; ++i)
+	{
+		page_t *page = &src->pages[i];
+		u32int flags, full;
+		if (!page->present)
+			continue;
+
+		if (page->frame >= nframes)
+		{
+			// Не память (MMIO) - просто отображаем туда же
+			table->pages[i] = *page;
+			continue;
+		}
+		flags = spin_lock_irqsave(&frames_lock);
+		full = frame_shares[page->frame] == 0xFF;
+		if (!full)
+			frame_shares[page->frame]++;
+		spin_unlock_irqrestore(&frames_lock, flags);
+		if (full)
+		{
+			// Счетчик переполнен - копируем кадр сразу
+			table->pages[i] = *page;
+			table->pages[i].frame = copy_frame(page->frame*0x1000) / 0x1000;
+			continue;
+		}
+
+		// Доступные для записи страницы становятся read-only
+		// в обоих пространствах, запись в них обработает page_fault
+		if (page->rw)
+		{
+			page->rw = 0;
+			page->cow = 1;
+			tlb_batch_add(batch, src_dir, base + i*0x1000, page);
+		}
+		table->pages[i] = *page;
+	}
+	return table;
+}
+
+page_directory_t *clone_directory(page_directory_t *src)
+{
+	page_directory_t *dir = (page_directory_t*)kmalloc_a(sizeof(page_directory_t));
+	vm_area_t *area, **link;
+	tlb_batch_t batch = { 0, 0, 0 };
+	u32int flags;
+	int i;
+
+	memset(dir, 0, sizeof(page_directory_t));
+	init_dir_lock(dir);
+	// Каталог занимает несколько страниц кучи, которые не обязаны
+	// лежать в памяти подряд, поэтому адрес берем у самого tablesPhysical
+	dir->physicalAddr = get_page((u32int)dir->tablesPhysical, 0, kernel_directory)->frame*0x1000;
+
+	// Верхняя четверть - таблицы ядра, их записи одинаковы во всех
+	// каталогах. Записи, появившиеся в kernel_directory позже, каталог
+	// получит при первом обращении (см. sync_kernel_pde)
+	for (i = KERNEL_TABLE_FIRST; i < RECURSIVE_TABLE; ++i)
+	{
+		dir->tables[i] = kernel_directory->tables[i];
+		dir->tablesPhysical[i] = kernel_directory->tablesPhysical[i];
+	}
+	dir->tablesPhysical[RECURSIVE_TABLE] = dir->physicalAddr | PDE_RW | PDE_PRESENT;
+
+	// Пока страницы делаются общими, другой процессор не должен
+	// заполнять их по page fault. У kernel_directory пользовательских
+	// областей и собственных таблиц нет: под его блокировкой куча
+	// не вызывается
+	flags = spin_lock_irqsave(&src->lock);
+	for (i = 0; i < KERNEL_TABLE_FIRST; ++i)
+	{
+		if (!src->tables[i])
+		{
+			// Пустая запись или 4 МБ страница ядра
+			dir->tablesPhysical[i] = src->tablesPhysical[i];
+			continue;
+		}
+		if (src->tables[i] == kernel_directory->tables[i])
+		{
+			// Таблица ядра - разделяем ее по ссылке
+			dir->tables[i] = src->tables[i];
+			dir->tablesPhysical[i] = src->tablesPhysical[i];
+		}
+		else
+		{
+			u32int phys;
+			dir->tables[i] = clone_table(src, i << 22, &batch, &phys);
+			dir->tablesPhysical[i] = phys | PDE_USER | PDE_RW | PDE_PRESENT;
+		}
+	}
+
+	link = &dir->areas;
+	for (area = src->areas; area && area->start < KERNEL_VIRTUAL_BASE; area = area->next)
+	{
+		*link = (vm_area_t*)kmalloc(sizeof(vm_area_t));
+		**link = *area;
+		link = &(*link)->next;
+	}
+	*link = 0;
+	spin_unlock_irqrestore(&src->lock, flags);
+
+	// Страницы исходного пространства стали read-only: если оно
+	// текущее, старые записи TLB нужно сбросить
+	tlb_batch_finish(&batch);
+
+	return dir;
+}
+
+void free_directory(page_directory_t *dir)
+{
+	vm_area_t *area, *next;
+	int i, j;
+
+	__sync_fetch_and_add(&table_gen, 1);
+	for (i = 0; i < KERNEL_TABLE_FIRST; ++i)
+	{
+		if (!dir->tables[i] || dir->tables[i] == kernel_directory->tables[i])
+			continue;
+		for (j = 0; j < 1024; ++j)
+			if (dir->tables[i]->pages[j].present)
+				free_frame(&dir->tables[i]->pages[j]);
+		kfree(dir->tables[i]);
+	}
+	for (area = dir->areas; area; area = next)
+	{
+		next = area->next;
+		kfree(area);
+	}
+	kfree(dir);
 }
 
 void switch_page_directory(page_directory_t *dir)
 {
-	current_directory = dir;
-	__asm__ volatile ("mov %0, %%cr3"::"r"(&dir->tablesPhysical));
-	u32int cr0;
-	__asm__ volatile ("mov %%cr0, %0": "=r"(cr0));
-	cr0 |= 0x80000000; // ВКЛ
-	__asm__ volatile ("mov %0, %%cr0":: "r"(cr0));
+	u32int cr3;
+
+	// Перезагрузка CR3 сбрасывает все неглобальные записи TLB,
+	// поэтому не делаем ее без необходимости. Сравниваем с тем, что
+	// действительно загружено на этом процессоре
+	set_current_directory(dir);
+	__asm__ volatile ("mov %%cr3, %0" : "=r"(cr3));
+	if (cr3 == dir->physicalAddr)
+		return;
+	__asm__ volatile ("mov %0, %%cr3"::"r"(dir->physicalAddr) : "memory");
+}
+
+// Looks the table up in this CPU's walk cache. Interrupts are off
+// so that neither an interrupt handler nor a migration to another
+// CPU can change the cache between the reads.
+static page_table_t *walk_cache_get(page_directory_t *dir, u32int idx)
+{
+	u32int flags = irq_save();
+	cpu_t *cpu = this_cpu();
+	page_table_t *table = 0;
+
+	if (cpu->walk_dir == dir && cpu->walk_idx == idx && cpu->walk_gen == table_gen)
+		table = cpu->walk_table;
+	irq_restore(flags);
+	return table;
+}
+
+// gen is table_gen as read before the table was found: if the table
+// was freed in between, the entry simply never matches.
+static void walk_cache_set(page_directory_t *dir, u32int idx, page_table_t *table, u32int gen)
+{
+	u32int flags = irq_save();
+	cpu_t *cpu = this_cpu();
+
+	cpu->walk_dir = dir;
+	cpu->walk_idx = idx;
+	cpu->walk_table = table;
+	cpu->walk_gen = gen;
+	irq_restore(flags);
 }
 
 page_t *get_page(u32int address, int make, page_directory_t *dir)
 {
+	page_table_t *table;
+	u32int gen = table_gen;
+
 	// Делаем из адреса индекс
 	address /= 0x1000;
 	// Находим таблицу, содержащую адрес
 	u32int table_idx = address / 1024;
-	if (dir->tables[table_idx]) // Если таблица уже создана
+	if (table_idx == RECURSIVE_TABLE)
+		return 0; // Сам каталог, а не таблица
+	// Таблицы ядра хранит kernel_directory, в остальных каталогах
+	// лишь копии его записей
+	if (table_idx >= KERNEL_TABLE_FIRST)
+		dir = kernel_directory;
+	// Соседние страницы обычно лежат в той же таблице, что и прошлая
+	if ((table = walk_cache_get(dir, table_idx)))
+		return &table->pages[address%1024];
+	if ((table = dir->tables[table_idx])) // Если таблица уже создана
+	{
+		walk_cache_set(dir, table_idx, table, gen);
+		return &table->pages[address%1024];
+	}
+	else if (dir->tablesPhysical[table_idx] & PDE_4MB)
+		return 0; // Адрес отображен 4 МБ страницей, таблицы нет
+	else if (make && table_idx >= KERNEL_TABLE_FIRST && recursive_ready)
+	{
+		// Таблицу ядра не берем из кучи: куча сама растет через
+		// get_page(). Кадр видим через рекурсивную запись каталога
+		u32int tmp = frame_alloc();
+		if (tmp == (u32int)-1)
+			PANIC("No free frames!");
+		dir->tables[table_idx] = (page_table_t*)PT_VIRT(table_idx);
+		dir->tablesPhysical[table_idx] = tmp | PDE_RW | PDE_PRESENT;
+		if (current_directory != dir)
+		{
+			current_directory->tables[table_idx] = dir->tables[table_idx];
+			current_directory->tablesPhysical[table_idx] = dir->tablesPhysical[table_idx];
+		}
+		invlpg(PT_VIRT(table_idx));
+		memset(dir->tables[table_idx], 0, 0x1000);
 		return &dir->tables[table_idx]->pages[address%1024];
+	}
 	else if(make)
 	{
 		u32int tmp;
 		dir->tables[table_idx] = (page_table_t*)kmalloc_ap(sizeof(page_table_t), &tmp);
+		if (!dir->tables[table_idx])
+			PANIC("No free frames!");
 		memset(dir->tables[table_idx], 0, 0x1000);
-		dir->tablesPhysical[table_idx] = tmp | 0x7; // PRESENT, RW, US
+		dir->tablesPhysical[table_idx] = tmp | PDE_USER | PDE_RW | PDE_PRESENT;
 		return &dir->tables[table_idx]->pages[address%1024];
 	}
 	else
 		return 0;
 }
 
-void page_fault(registers_t regs)
+int vmm_reserve(page_directory_t *dir, u32int start, u32int len, u32int flags)
 {
+	u32int end = (start + len + 0xFFF) & 0xFFFFF000;
+	vm_area_t **link = &dir->areas;
+	vm_area_t *area;
+	u32int irq_flags;
+
+	start &= 0xFFFFF000;
+	if (end <= start)
+		return -1;
+
+	// Память под область берем до блокировки (см. page_directory_t.lock)
+	area = (vm_area_t*)kmalloc(sizeof(vm_area_t));
+	area->start = start;
+	area->end = end;
+	area->flags = flags;
+
+	// Ищем место в упорядоченном списке
+	irq_flags = spin_lock_irqsave(&dir->lock);
+	while (*link && (*link)->end <= start)
+		link = &(*link)->next;
+	if (*link && (*link)->start < end)
+	{
+		spin_unlock_irqrestore(&dir->lock, irq_flags);
+		kfree(area);
+		return -1;
+	}
+	area->next = *link;
+	*link = area;
+	spin_unlock_irqrestore(&dir->lock, irq_flags);
+	return 0;
+}
+
+void vmm_release(page_directory_t *dir, u32int start)
+{
+	vm_area_t **link = &dir->areas;
+	vm_area_t *area;
+	tlb_batch_t batch = { 0, 0, 0 };
+	u32int addr, flags = spin_lock_irqsave(&dir->lock);
+
+	while (*link && (*link)->start != start)
+		link = &(*link)->next;
+	if (!(area = *link))
+	{
+		spin_unlock_irqrestore(&dir->lock, flags);
+		return;
+	}
+	*link = area->next;
+
+	// Сначала снимаем отображения и сбрасываем TLB всех процессоров,
+	// только потом отдаем кадры: до сброса их еще можно прочитать
+	for (addr = area->start; addr < area->end; addr += 0x1000)
+	{
+		page_t *page = get_page(addr, 0, dir);
+		if (!page)
+		{
+			// Таблицы нет - пропускаем сразу все ее страницы
+			addr = (addr | 0x3FFFFF) - 0xFFF;
+			continue;
+		}
+		if (page->present)
+		{
+			page->present = 0;
+			tlb_batch_add(&batch, dir, addr, page);
+		}
+	}
+	tlb_batch_finish(&batch);
+	for (addr = area->start; addr < area->end; addr += 0x1000)
+	{
+		page_t *page = get_page(addr, 0, dir);
+		if (!page)
+			addr = (addr | 0x3FFFFF) - 0xFFF;
+		else if (page->frame)
+			free_frame(page);
+	}
+	spin_unlock_irqrestore(&dir->lock, flags);
+	kfree(area);
+}
+
+// Handles a write to a copy-on-write page. Returns 0 if the page
+// is not copy-on-write.
+static int cow_page(u32int addr)
+{
+	page_directory_t *dir = current_directory;
+	u32int irq_flags = spin_lock_irqsave(&dir->lock);
+	page_t *page = get_page(addr, 0, dir);
+
+	if (!page || !page->present || (!page->cow && !page->rw))
+	{
+		spin_unlock_irqrestore(&dir->lock, irq_flags);
+		return 0;
+	}
+	// Другой процессор обработал запись в эту страницу, пока мы
+	// ждали блокировку: копировать второй раз нечего
+	if (!page->cow)
+	{
+		spin_unlock_irqrestore(&dir->lock, irq_flags);
+		return 1;
+	}
+
+	addr &= 0xFFFFF000;
+	if (frame_shares[page->frame])
+	{
+		// Кадр еще разделяется - забираем себе копию. Свою ссылку
+		// отдаем только после копирования: иначе последний владелец
+		// начнет писать в кадр, пока мы его читаем
+		u32int frame = frame_alloc(), flags;
+		if (frame == (u32int)-1)
+			PANIC("No free frames!");
+		memcpy(map_window(0, frame), (void*)addr, 0x1000);
+		flags = spin_lock_irqsave(&frames_lock);
+		if (frame_shares[page->frame])
+		{
+			frame_shares[page->frame]--;
+			page->frame = frame / 0x1000;
+			vm_stats.cow_copies++;
+			frame = (u32int)-1;
+		}
+		spin_unlock_irqrestore(&frames_lock, flags);
+		// Остальные владельцы успели отказаться от кадра сами
+		if (frame != (u32int)-1)
+			frame_free(frame);
+	}
+	// Последний владелец кадра просто получает право записи.
+	// Каталог могут выполнять и другие процессоры: у них в TLB
+	// старый кадр или запись только для чтения
+	page->rw = 1;
+	page->cow = 0;
+	invlpg(addr);
+	tlb_shootdown(0);
+	spin_unlock_irqrestore(&dir->lock, irq_flags);
+	return 1;
+}
+
+static vm_area_t *find_area(page_directory_t *dir, u32int addr)
+{
+	vm_area_t *area;
+	for (area = dir->areas; area && area->start <= addr; area = area->next)
+		if (addr < area->end)
+			return area;
+	return 0;
+}
+
+// Handles a not-present fault inside a reserved area: backs the page
+// with a zeroed frame. Returns 0 if the access is not allowed.
+static int demand_page(u32int addr, u32int err_code)
+{
+	int kernel = addr >= KERNEL_VIRTUAL_BASE;
+	page_directory_t *dir = kernel ? kernel_directory : current_directory;
+	vm_area_t *area;
+	page_t *page;
+	u32int frame, flags = spin_lock_irqsave(&dir->lock);
+
+	area = find_area(dir, addr);
+	if (!area || ((err_code & 0x2) && !(area->flags & VMA_WRITE)) ||
+		((err_code & 0x4) && !(area->flags & VMA_USER)))
+	{
+		spin_unlock_irqrestore(&dir->lock, flags);
+		return 0;
+	}
+
+	addr &= 0xFFFFF000;
+	page = get_page(addr, 1, current_directory);
+	// Другой процессор мог обратиться к той же странице и выделить
+	// ей кадр, пока мы ждали блокировку
+	if (!page->present)
+	{
+		// Обнуляем кадр через окно и только потом отображаем его с правами
+		// области: запись с другими правами не попадет ни в чей TLB
+		frame = frame_alloc();
+		if (frame == (u32int)-1)
+			PANIC("No free frames!");
+		memset(map_window(0, frame), 0, 0x1000);
+		*(u32int*)page = frame | PAGE_PRESENT |
+			((area->flags & VMA_WRITE) ? PAGE_RW : 0) |
+			((area->flags & VMA_USER) ? PAGE_USER : 0) |
+			(kernel ? PAGE_GLOBAL : 0);
+	}
+	spin_unlock_irqrestore(&dir->lock, flags);
+	return 1;
+}
+
+// Copies a kernel directory entry that appeared after the current
+// directory was cloned. Returns 0 if there was nothing to copy.
+static int sync_kernel_pde(u32int addr)
+{
+	u32int idx = addr >> 22;
+	// Обращение к таблице через рекурсивную запись
+	if (idx == RECURSIVE_TABLE)
+		idx = (addr >> 12) & 0x3FF;
+	if (idx < KERNEL_TABLE_FIRST || idx == RECURSIVE_TABLE)
+		return 0;
+	if (!(kernel_directory->tablesPhysical[idx] & PDE_PRESENT) ||
+		current_directory->tablesPhysical[idx] == kernel_directory->tablesPhysical[idx])
+		return 0;
+	current_directory->tables[idx] = kernel_directory->tables[idx];
+	current_directory->tablesPhysical[idx] = kernel_directory->tablesPhysical[idx];
+	return 1;
+}
+
+void page_fault(registers_t *regs)
+{
+	u64int start = rdtsc();
+
 	// Произошло прерывание page fault
 	// Адрес по которому произошло прерывание содержится в регистре CR2
 	u32int faulting_address;
 	__asm__ volatile ("mov %%cr2, %0" : "=r"(faulting_address));
 
+	if (!(regs->err_code & 0x1) && sync_kernel_pde(faulting_address))
+	{
+		vm_stats.minor_faults++;
+		vm_stats.fault_cycles += rdtsc() - start;
+		return;
+	}
+	if (!(regs->err_code & 0x1) && demand_page(faulting_address, regs->err_code))
+	{
+		// Страница отображена, инструкция будет выполнена повторно
+		vm_stats.minor_faults++;
+		vm_stats.fault_cycles += rdtsc() - start;
+		return;
+	}
+	if ((regs->err_code & 0x3) == 0x3 && cow_page(faulting_address))
+	{
+		vm_stats.cow_faults++;
+		vm_stats.fault_cycles += rdtsc() - start;
+		return;
+	}
+
 	// Код ошибки сообщит нам подробности произошедшего
-	int present = !(regs.err_code & 0x1);	// Page not present
-	int rw = regs.err_code & 0x2;			// Write operation ?
-	int us = regs.err_code & 0x4;			// Processor was in user-mode?
-	int reserved = regs.err_code & 0x8;		// Overwritten CPU reserved bits
-	int id = regs.err_code & 0x10;			// Caused by an instruction
+	int present = !(regs->err_code & 0x1);	// Page not present
+	int rw = regs->err_code & 0x2;			// Write operation ?
+	int us = regs->err_code & 0x4;			// Processor was in user-mode?
+	int reserved = regs->err_code & 0x8;		// Overwritten CPU reserved bits
+	int id = regs->err_code & 0x10;			// Caused by an instruction
 
 	// Error message
-	monitor_write("Page fault! (");
-	if (present) monitor_write("present ");
-	if (rw) monitor_write("read-only ");
-	if (us) monitor_write("user-mode ");
-	if (reserved) monitor_write("reserved ");
-	monitor_write(") at 0x");
-	monitor_write_hex(faulting_address);
-	monitor_write("\n");
+	kprintf("Page fault! (%s%s%s%s) at %p\n",
+		present ? "present " : "",
+		rw ? "read-only " : "",
+		us ? "user-mode " : "",
+		reserved ? "reserved " : "",
+		(void*)faulting_address);
+	klog_dump();
 	PANIC("Page fault");
 }
 
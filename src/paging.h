@@ -3,15 +3,22 @@
 
 #include "common.h"
 #include "isr.h"
+#include "spinlock.h"
+#include "multiboot.h"
 
 typedef struct page
 {
 	u32int present	: 1;	// Страница представлена в памяти
-	u32int rw		: 1;	// Если установлен - то read-only
+	u32int rw		: 1;	// Если сброшен - то read-only
 	u32int user		: 1;	// Если сброшен - то уровень ядра
+	u32int pwt		: 1;	// Сквозная запись (write-through)
+	u32int pcd		: 1;	// Кэширование запрещено
 	u32int accessed	: 1;	// Был ли доступ к странице
 	u32int dirty	: 1;	// Была ли запись в страницу
-	u32int unused	: 7;	// Зарезервированные и неиспользуемые биты
+	u32int pat		: 1;	// Зарезервировано (PAT)
+	u32int global	: 1;	// Зарезервировано (глобальная страница)
+	u32int cow		: 1;	// Копировать при записи. Биты 9-11
+	u32int unused	: 2;	// оставлены процессором для нужд ОС
 	u32int frame	: 20;	// Адрес кадра
 } page_t;
 
@@ -20,6 +27,60 @@ typedef struct page_table
 	page_t pages[1024];
 } page_table_t;
 
+// Таблицы верхней четверти адресного пространства принадлежат ядру
+// и разделяются всеми каталогами
+#define KERNEL_TABLE_FIRST	(KERNEL_VIRTUAL_BASE >> 22)
+
+// Последняя запись каждого каталога указывает на сам каталог, поэтому
+// таблица i текущего каталога всегда видна по адресу PT_VIRT(i)
+#define RECURSIVE_TABLE		1023
+#define PT_VIRT(i)			(0xFFC00000 + (i)*0x1000)
+
+// Фиксированные отображения ядра: одна таблица перед рекурсивной записью.
+// Слот - номер страницы в ней
+#define KERNEL_FIXMAP		0xFF800000
+#define FIXMAP_ADDR(slot)	(KERNEL_FIXMAP + (slot)*0x1000)
+#define FIXMAP_LAPIC		2	// Регистры local APIC
+#define FIXMAP_IOAPIC		3	// Регистры IOAPIC, по слоту на каждый
+#define FIXMAP_ACPI			8	// Окно для чтения таблиц ACPI
+#define FIXMAP_ACPI_PAGES	16
+#define FIXMAP_COPY			32	// Два окна для копирования кадров на каждый процессор
+
+// Флаги записей каталога страниц
+#define PDE_PRESENT	0x001
+#define PDE_RW		0x002
+#define PDE_USER	0x004
+#define PDE_4MB		0x080	// Запись отображает 4 МБ страницу (PSE)
+#define PDE_GLOBAL	0x100	// Глобальная страница (только для 4 МБ)
+
+// Флаги записей таблиц страниц для map_page() и protect_range()
+#define PAGE_PRESENT	0x001
+#define PAGE_RW			0x002
+#define PAGE_USER		0x004
+#define PAGE_PWT		0x008
+#define PAGE_PCD		0x010
+#define PAGE_GLOBAL		0x100
+
+// Возможности процессора, задействованные при включении страничной адресации
+#define PAGING_PSE	0x1		// Страницы по 4 МБ
+#define PAGING_PGE	0x2		// Глобальные страницы
+
+// Флаги областей виртуальной памяти
+#define VMA_WRITE	0x1		// Запись разрешена
+#define VMA_USER	0x2		// Доступна из пространства пользователя
+
+/**
+ * Область виртуальной памяти, кадры для которой выделяются
+ * при первом обращении к странице
+ */
+typedef struct vm_area
+{
+	u32int start;			// Начало области, выровнено по странице
+	u32int end;				// Конец области (не включая)
+	u32int flags;			// VMA_*
+	struct vm_area *next;	// Следующая область по возрастанию адресов
+} vm_area_t;
+
 typedef struct page_directory
 {
 	/**
@@ -37,29 +98,223 @@ typedef struct page_directory
 	 * если куча ядра уже выделена, а каталог страниц
 	 * находится не в ней
 	 */
+	u32int physicalAddr;
+	/**
+	 * Зарезервированные области виртуальной памяти,
+	 * упорядоченные по адресу
+	 */
+	vm_area_t *areas;
+	/**
+	 * Защищает areas и заполнение страниц по page fault. Берется
+	 * раньше heap_lock; page fault в служебных данных кучи сам берет
+	 * блокировку kernel_directory, поэтому под ней куча не вызывается
+	 */
+	spinlock_t lock;
 } page_directory_t;
 
 /**
- * Настраивает окружение и включает страничную адресацию
+ * Статистика обработчика page fault
+ */
+typedef struct vm_stats
+{
+	u32int minor_faults;	// Страниц, выделенных по первому обращению
+	u32int cow_faults;		// Записей в разделяемые страницы
+	u32int cow_copies;		// Из них потребовали копирования кадра
+	u64int fault_cycles;	// Тактов, потраченных на их обработку
+} vm_stats_t;
+
+extern vm_stats_t vm_stats;
+
+/**
+ * Каталог страниц ядра
+ */
+extern page_directory_t *kernel_directory;
+
+/**
+ * Каталог, загруженный в CR3 текущего процессора. У каждого процессора
+ * свой (cpu_t.dir), читается одной инструкцией через gs
  */
-extern void initialise_paging();
+static inline page_directory_t *get_current_directory()
+{
+	page_directory_t *dir;
+	__asm__ volatile ("mov %%gs:16, %0" : "=r"(dir));
+	return dir;
+}
+#define current_directory get_current_directory()
 
 /**
- * Загружает адрес каталога страниц в регистр CR3
+ * PAGING_*: какие возможности процессора используются
+ */
+extern u32int paging_flags;
+
+/**
+ * Настраивает окружение и включает страничную адресацию.
+ * Объем памяти берется из информации загрузчика
+ */
+extern void initialise_paging(multiboot_t *mboot);
+
+/**
+ * Загружает адрес каталога страниц в регистр CR3. Если каталог
+ * уже текущий, ничего не делает и TLB не сбрасывается
  */
 extern void switch_page_directory(page_directory_t *new);
 
+/**
+ * Создает копию адресного пространства. Таблицы ядра разделяются
+ * по ссылке, остальные страницы разделяются с копированием при
+ * записи: кадр копируется только при первой записи в него
+ */
+extern page_directory_t *clone_directory(page_directory_t *src);
+
+/**
+ * Освобождает каталог, созданный clone_directory(), вместе с
+ * его собственными таблицами и кадрами. Каталог не должен быть
+ * текущим
+ */
+extern void free_directory(page_directory_t *dir);
+
 /**
  * Возвращает указатель на запрашиваемую страницу
  * Если make=1 и таблица страниц не существует, то
- * создает таблицу.
+ * создает таблицу. Для адресов, отображенных 4 МБ
+ * страницами, возвращает 0. Страницы ядра всегда
+ * ищутся в kernel_directory.
  */
 extern page_t *get_page(u32int address, int make, page_directory_t *dir);
 
+/**
+ * Количество кадров физической памяти и сколько из них свободно
+ */
+extern u32int nframes;
+extern u32int nfree_frames;
+
+/**
+ * Битовая карта кадров: установленный бит - кадр занят
+ */
+extern u32int *frames;
+
+/**
+ * Защищает битовую карту кадров, карты buddy.c и счетчики разделения
+ * кадров. Берется только через spin_lock_irqsave()
+ */
+extern spinlock_t frames_lock;
+
+/**
+ * Помечает кадр по физическому адресу занятым/свободным
+ * и проверяет, занят ли он. set_frame() и clear_frame() вызываются
+ * под frames_lock (или пока работает один процессор)
+ */
+extern void set_frame(u32int frame_addr);
+extern void clear_frame(u32int frame_addr);
+extern u32int test_frame(u32int frame_addr);
+
+/**
+ * Создает битовую карту на n кадров, все кадры заняты
+ */
+extern void init_frames(u32int n);
+
+/**
+ * Выделяет свободный кадр и возвращает его физический адрес,
+ * либо -1, если свободных кадров не осталось
+ */
+extern u32int frame_alloc();
+
+/**
+ * Возвращает кадр, выделенный frame_alloc()
+ */
+extern void frame_free(u32int frame_addr);
+
+/**
+ * Выделяет кадр для страницы, если он еще не выделен
+ */
+extern void alloc_frame(page_t *page, int is_kernel, int is_writeable);
+
+/**
+ * Освобождает кадр страницы и помечает ее отсутствующей
+ */
+extern void free_frame(page_t *page);
+
+/**
+ * Резервирует область [start, start+len) без выделения кадров.
+ * Кадры выделяются и обнуляются обработчиком page fault при первом
+ * обращении к странице. Возвращает -1, если область пересекается
+ * с уже зарезервированной
+ */
+extern int vmm_reserve(page_directory_t *dir, u32int start, u32int len, u32int flags);
+
+/**
+ * Снимает резервирование области, начинающейся с start,
+ * и освобождает все выделенные для нее кадры
+ */
+extern void vmm_release(page_directory_t *dir, u32int start);
+
+/**
+ * Сколько страниц сбрасывать по одной инструкцией invlpg.
+ * При изменении большего числа страниц TLB сбрасывается целиком
+ */
+extern u32int tlb_flush_threshold;
+
+/**
+ * Отображает страницу vaddr на кадр paddr с флагами PAGE_*.
+ * Если страница уже была отображена, сбрасывает ее запись TLB
+ * (на других процессорах - через tlb_shootdown())
+ */
+extern void map_page(page_directory_t *dir, u32int vaddr, u32int paddr, u32int flags);
+
+/**
+ * Отображает [vaddr, vaddr+len) на физически непрерывную область,
+ * начинающуюся с paddr. Недостающие таблицы создаются по одной на
+ * каждые 4 МБ, записи внутри таблицы заполняются подряд
+ */
+extern void map_range(page_directory_t *dir, u32int vaddr, u32int paddr, u32int len, u32int flags);
+
+/**
+ * Снимает отображение страницы vaddr и возвращает физический адрес
+ * ее кадра (0, если страница не была отображена). Кадр не освобождается
+ */
+extern u32int unmap_page(page_directory_t *dir, u32int vaddr);
+
+/**
+ * Убирает из каталога таблицу пользовательской части с адресом vaddr,
+ * если в ней не осталось отображенных страниц. Нужна после временных
+ * отображений в kernel_directory: его таблицы clone_directory()
+ * разделяет со всеми пространствами по ссылке
+ */
+extern void free_user_table(page_directory_t *dir, u32int vaddr);
+
+/**
+ * Меняет права доступа (PAGE_RW, PAGE_USER) отображенных страниц
+ * в диапазоне [vaddr, vaddr+len)
+ */
+extern void protect_range(page_directory_t *dir, u32int vaddr, u32int len, u32int flags);
+
+/**
+ * Сбрасывает TLB остальных процессоров (global - вместе с глобальными
+ * записями) и ждет, пока все они это сделают. Вызывается после изменения
+ * записей, которые могли попасть в их TLB, и до того, как освобожденный
+ * кадр или адрес будут использованы снова. Можно вызывать с выключенными
+ * прерываниями и под блокировками: ждущие блокировку процессоры
+ * выполняют запрос в lock_relax()
+ */
+extern void tlb_shootdown(int global);
+
+/**
+ * Выполняет сброс TLB, запрошенный у текущего процессора
+ */
+extern void tlb_flush_requested();
+
+/**
+ * Сбрасывает запись TLB для страницы по адресу addr
+ */
+static inline void invlpg(u32int addr)
+{
+	__asm__ volatile ("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
 /**
  * Обработчик Page fault
  */
-extern void page_fault(registers_t regs);
+extern void page_fault(registers_t *regs);
 
 #endif
 
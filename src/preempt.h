@@ -0,0 +1,24 @@
+// preempt.h -- Disabling preemption of the current task
+
+#ifndef PREEMPT_H_
+#define PREEMPT_H_
+
+#include "common.h"
+
+/**
+ * Запрещает вытеснение текущей задачи до парного preempt_enable().
+ * Счетчик у каждого процессора свой (cpu_t.preempt_count, %gs:12),
+ * меняется одной инструкцией
+ */
+static inline void preempt_disable()
+{
+	__asm__ volatile ("incl %%gs:12" : : : "memory");
+}
+
+/**
+ * Снова разрешает вытеснение. Если квант кончился, пока оно было
+ * запрещено, переключается на другую задачу (task.c)
+ */
+extern void preempt_enable();
+
+#endif
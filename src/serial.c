@@ -0,0 +1,180 @@
+// serial.c -- Interrupt-driven output to the COM1 serial port
+
+#include "serial.h"
+#include "console.h"
+#include "isr.h"
+
+// Регистры 16550 относительно базового порта
+#define UART_DATA	0	// THR при записи; с DLAB=1 - младший байт делителя
+#define UART_IER	1	// Разрешение прерываний; с DLAB=1 - старший байт делителя
+#define UART_IIR	2	// Идентификация прерывания при чтении
+#define UART_FCR	2	// Управление FIFO при записи
+#define UART_LCR	3
+#define UART_MCR	4
+#define UART_LSR	5
+#define UART_SCR	7
+
+#define LSR_THRE	0x20	// Регистр передатчика пуст
+#define IER_THRE	0x02
+#define UART_FIFO	16		// Глубина FIFO передатчика
+
+// Кольцо передачи: пишут все процессоры без блокировок, читает
+// только обработчик IRQ4. Слот с номером pos свободен, когда его seq
+// равен pos, и заполнен, когда seq равен pos + 1. Писатель резервирует
+// подряд идущие слоты, сдвигая tx_head через cmpxchg, заполняет их
+// и публикует каждый записью seq
+typedef struct tx_slot
+{
+	volatile u32int seq;
+	char c;
+} tx_slot_t;
+
+static tx_slot_t tx_ring[SERIAL_TX_RING];
+static volatile u32int tx_head = 0;
+static u32int tx_tail = 0;			// Меняет только обработчик IRQ4
+// Прерывание THRE включено: обработчик разберет кольцо. Переводит
+// 0 -> 1 тот, кто включает прерывание, 1 -> 0 - обработчик, которому
+// нечего передавать. Порт IER пишет только тот, кто сделал переход
+static volatile u32int tx_busy = 0;
+
+// Сколько слотов резервировать за раз: строка одного вызова
+// serial_write() не перемешивается с чужим выводом
+#define TX_BATCH	64
+
+static int serial_present = 0;
+
+u32int serial_dropped = 0;
+
+static console_t serial_console = { "serial", serial_write, 0 };
+
+// Загружает в FIFO до UART_FIFO опубликованных байт кольца. Вызывается
+// только из обработчика прерывания, когда передатчик пуст
+static u32int serial_fill_fifo()
+{
+	u32int n;
+	for (n = 0; n < UART_FIFO; ++n)
+	{
+		tx_slot_t *slot = &tx_ring[tx_tail & (SERIAL_TX_RING - 1)];
+		if (slot->seq != tx_tail + 1)
+			break;
+		outb(COM1_PORT + UART_DATA, slot->c);
+		__asm__ volatile ("" : : : "memory");
+		// Слот свободен для записи через круг
+		slot->seq = tx_tail + SERIAL_TX_RING;
+		tx_tail++;
+	}
+	return n;
+}
+
+// Включает прерывание THRE, если его еще никто не включил. Если
+// регистр передатчика пуст, 16550 сразу выставляет прерывание
+static void serial_kick()
+{
+	if (!tx_busy && __sync_bool_compare_and_swap(&tx_busy, 0, 1))
+		outb(COM1_PORT + UART_IER, IER_THRE);
+}
+
+static void serial_callback(registers_t *regs)
+{
+	// Чтение IIR сбрасывает условие прерывания THRE
+	inb(COM1_PORT + UART_IIR);
+	if (!(inb(COM1_PORT + UART_LSR) & LSR_THRE) || serial_fill_fifo())
+		return;
+
+	// Передавать нечего - выключаем прерывание, пока писатель не
+	// включит его снова. Писатель мог опубликовать байт, увидев еще
+	// tx_busy == 1: после сброса флага проверяем кольцо еще раз
+	outb(COM1_PORT + UART_IER, 0x00);
+	tx_busy = 0;
+	__sync_synchronize();
+	if (tx_ring[tx_tail & (SERIAL_TX_RING - 1)].seq == tx_tail + 1)
+		serial_kick();
+}
+
+// Резервирует n подряд идущих слотов и возвращает номер первого
+// в *pos. 0 - кольцо заполнено
+static int ring_reserve(u32int n, u32int *pos)
+{
+	u32int head;
+	s32int diff;
+
+	do
+	{
+		head = tx_head;
+		// Обработчик освобождает слоты по порядку: если свободен
+		// последний из нужных, свободны и остальные
+		diff = tx_ring[(head + n - 1) & (SERIAL_TX_RING - 1)].seq - (head + n - 1);
+		if (diff < 0)
+			return 0;
+		// diff > 0 - head устарел, слот уже занял другой писатель
+	} while (diff || !__sync_bool_compare_and_swap(&tx_head, head, head + n));
+	*pos = head;
+	return 1;
+}
+
+static inline void ring_publish(u32int pos, char c)
+{
+	tx_slot_t *slot = &tx_ring[pos & (SERIAL_TX_RING - 1)];
+	slot->c = c;
+	__asm__ volatile ("" : : : "memory");
+	slot->seq = pos + 1;
+}
+
+void serial_write(const char *buf, u32int len)
+{
+	if (!serial_present)
+		return;
+
+	while (len)
+	{
+		u32int n = 0, i, pos;
+
+		// Терминалу нужен возврат каретки перед переводом строки
+		for (i = 0; i < len && n + 2 <= TX_BATCH; ++i)
+			n += (buf[i] == '\n') ? 2 : 1;
+		if (ring_reserve(n, &pos))
+		{
+			for (n = 0; n < i; ++n)
+			{
+				if (buf[n] == '\n')
+					ring_publish(pos++, '\r');
+				ring_publish(pos++, buf[n]);
+			}
+		}
+		else
+			__sync_fetch_and_add(&serial_dropped, n);
+		buf += i;
+		len -= i;
+	}
+
+	// Байты опубликованы до чтения tx_busy: либо мы включим
+	// прерывание, либо обработчик увидит их при повторной проверке
+	__sync_synchronize();
+	serial_kick();
+}
+
+int init_serial()
+{
+	u32int i;
+
+	// Порта нет, если scratch-регистр не хранит записанное
+	outb(COM1_PORT + UART_SCR, 0x5A);
+	if (inb(COM1_PORT + UART_SCR) != 0x5A)
+		return 0;
+
+	outb(COM1_PORT + UART_IER, 0x00);	// Пока без прерываний
+	outb(COM1_PORT + UART_LCR, 0x80);	// DLAB: доступ к делителю
+	outb(COM1_PORT + UART_DATA, 0x01);	// 115200 / 1 = 115200 бод
+	outb(COM1_PORT + UART_IER, 0x00);
+	outb(COM1_PORT + UART_LCR, 0x03);	// 8 бит, без четности, 1 стоп-бит
+	outb(COM1_PORT + UART_FCR, 0xC7);	// Включить и очистить FIFO
+	outb(COM1_PORT + UART_MCR, 0x0B);	// DTR, RTS и OUT2 - без OUT2 нет IRQ
+
+	for (i = 0; i < SERIAL_TX_RING; ++i)
+		tx_ring[i].seq = i;
+	register_interrupt_handler(IRQ4, &serial_callback);
+	serial_present = 1;
+
+	console_register(&serial_console);
+	return 1;
+}
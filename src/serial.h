@@ -0,0 +1,30 @@
+// serial.h -- Interrupt-driven output to the COM1 serial port
+
+#ifndef SERIAL_H_
+#define SERIAL_H_
+
+#include "common.h"
+
+#define COM1_PORT	0x3F8
+
+// Размер кольца передачи, степень двойки
+#define SERIAL_TX_RING	4096
+
+/**
+ * Настраивает COM1 на 115200 8N1 с FIFO, включает прерывание
+ * "регистр передатчика пуст" (IRQ4) и регистрирует порт как
+ * backend консоли. Возвращает 0, если порта нет.
+ */
+extern int init_serial();
+
+/**
+ * Ставит len байт в кольцо передачи и не ждет их отправки.
+ * Если кольцо заполнено, лишние байты отбрасываются. Блокировок
+ * не берет: можно вызывать с любого процессора и из прерываний.
+ */
+extern void serial_write(const char *buf, u32int len);
+
+// Сколько байт отброшено из-за переполнения кольца
+extern u32int serial_dropped;
+
+#endif
@@ -0,0 +1,145 @@
+// smp.c -- Starting application processors and per-CPU data
+
+#include "smp.h"
+#include "paging.h"
+#include "kheap.h"
+#include "clock.h"
+#include "klog.h"
+#include "task.h"
+#include "timer.h"
+
+// Сколько ждать, пока AP отметится (мкс)
+#define SMP_INIT_DELAY		10000
+#define SMP_SIPI_DELAY		200
+#define SMP_ONLINE_TIMEOUT	100000
+
+cpu_t boot_cpu;
+cpu_t *cpus[SMP_MAX_CPUS] = { &boot_cpu };
+u32int smp_ncpus = 1;
+
+// Параметры трамплина, порядок как в trampoline.s
+typedef struct trampoline_params
+{
+	u32int cr3;
+	u32int cr4;
+	u32int esp;
+	u32int entry;
+} trampoline_params_t;
+
+// Defined in trampoline.s
+extern u8int trampoline_start[];
+extern u8int trampoline_params[];
+extern u8int trampoline_end[];
+
+// Процессор, который запускается сейчас. AP запускаются по одному
+static cpu_t *volatile ap_booting = 0;
+
+// Сюда AP попадает из трамплина: страничная адресация включена,
+// стек - cpu->stack
+static void ap_main()
+{
+	cpu_t *cpu = ap_booting;
+	u32int cr3;
+
+	init_cpu_descriptor_tables(cpu);
+	init_fpu();
+	lapic_init_cpu();
+	// Тики для квантов задач и балансировки очередей; таймеры
+	// ядра (timer.c) по-прежнему обслуживает только BSP
+	lapic_timer_start(TIMER_HZ);
+
+	// Трамплин отображен сам на себя только на время запуска:
+	// убираем его запись из TLB, прежде чем BSP снимет отображение
+	__asm__ volatile ("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) : : "memory");
+
+	__sync_synchronize();
+	cpu->online = 1;
+
+	// Дальше этот код - задача idle процессора
+	task_idle();
+}
+
+// Другой процессор изменил таблицы страниц, см. tlb_shootdown()
+static void tlb_ipi(registers_t *regs)
+{
+	tlb_flush_requested();
+}
+
+// Ждет, пока cpu отметится, не дольше us микросекунд
+static int wait_online(cpu_t *cpu, u32int us)
+{
+	for (; us && !cpu->online; us -= 10)
+		udelay(10);
+	return cpu->online;
+}
+
+static int start_ap(u32int apic_id)
+{
+	trampoline_params_t *params = (trampoline_params_t*)
+		PHYS_TO_VIRT(SMP_TRAMPOLINE + (trampoline_params - trampoline_start));
+	cpu_t *cpu = (cpu_t*)kmalloc(sizeof(cpu_t));
+	u32int cr4;
+
+	memset(cpu, 0, sizeof(cpu_t));
+	cpu->id = smp_ncpus;
+	cpu->apic_id = apic_id;
+	cpu->stack = kmalloc(SMP_STACK_SIZE) + SMP_STACK_SIZE;
+	// Трамплин загружает в CR3 каталог ядра
+	cpu->dir = kernel_directory;
+	task_init_cpu(cpu);
+
+	__asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+	params->cr3 = kernel_directory->physicalAddr;
+	params->cr4 = cr4;
+	params->esp = cpu->stack;
+	params->entry = (u32int)&ap_main;
+	ap_booting = cpu;
+	__sync_synchronize();
+
+	// INIT сбрасывает процессор, SIPI запускает его с адреса
+	// вектор*0x1000. Второй SIPI - на случай, если первый потерян
+	apic_send_ipi(apic_id, ICR_INIT | ICR_ASSERT | ICR_LEVEL);
+	udelay(SMP_INIT_DELAY);
+	apic_send_ipi(apic_id, ICR_STARTUP | (SMP_TRAMPOLINE >> 12));
+	if (!wait_online(cpu, SMP_SIPI_DELAY))
+	{
+		apic_send_ipi(apic_id, ICR_STARTUP | (SMP_TRAMPOLINE >> 12));
+		if (!wait_online(cpu, SMP_ONLINE_TIMEOUT))
+		{
+			// Стек и данные не освобождаем: процессор может
+			// проснуться позже и начать ими пользоваться
+			klog("smp: cpu %x did not start\n", apic_id);
+			return 0;
+		}
+	}
+
+	cpus[smp_ncpus++] = cpu;
+	return 1;
+}
+
+u32int init_smp()
+{
+	u32int i;
+
+	boot_cpu.online = 1;
+	if (!apic_active)
+		return smp_ncpus;
+	boot_cpu.apic_id = lapic_id();
+	register_interrupt_handler(IRQ_TLB_SHOOTDOWN, &tlb_ipi);
+
+	// Трамплин работает по физическому адресу и включает страничную
+	// адресацию сам: его страница должна быть отображена сама на себя
+	memcpy((void*)PHYS_TO_VIRT(SMP_TRAMPOLINE), trampoline_start, trampoline_end - trampoline_start);
+	map_page(kernel_directory, SMP_TRAMPOLINE, SMP_TRAMPOLINE, PAGE_RW);
+
+	for (i = 1; i < apic_ncpus && smp_ncpus < SMP_MAX_CPUS; ++i)
+		start_ap(apic_cpu_ids[i]);
+
+	// map_page() создал для трамплина таблицу 0 - убираем ее, чтобы
+	// пространства задач не получили ее вместе с таблицами ядра
+	unmap_page(kernel_directory, SMP_TRAMPOLINE);
+	free_user_table(kernel_directory, SMP_TRAMPOLINE);
+	ap_booting = 0;
+	klog("smp: %d of %d cpus online\n", smp_ncpus, apic_ncpus);
+	return smp_ncpus;
+}
@@ -0,0 +1,84 @@
+// smp.h -- Starting application processors and per-CPU data
+
+#ifndef SMP_H_
+#define SMP_H_
+
+#include "common.h"
+#include "descriptor_tables.h"
+#include "apic.h"
+#include "softirq.h"
+
+#define SMP_MAX_CPUS		APIC_MAX_CPUS
+#define SMP_STACK_SIZE		0x2000
+
+// Физический адрес, с которого AP начинают работу в реальном режиме.
+// Кадр зарезервирован в initialise_paging()
+#define SMP_TRAMPOLINE		0x8000
+
+/**
+ * Данные одного процессора. Сегмент GDT_PERCPU начинается с этой
+ * структуры, поэтому ее поля доступны как %gs:смещение
+ */
+typedef struct cpu
+{
+	struct cpu *self;			// %gs:0 - адрес самой структуры
+	u32int id;					// %gs:4 - номер процессора, у BSP 0
+	struct task *current;		// %gs:8 - задача, выполняемая на нем
+	volatile u32int preempt_count;	// %gs:12 - см. preempt_disable()
+	struct page_directory *dir;	// %gs:16 - каталог, загруженный в CR3 (paging.h)
+	volatile u32int tlb_pending;	// %gs:20 - запрошен сброс TLB, см. tlb_shootdown()
+	volatile u32int sse_busy;	// %gs:24 - memcpy/memset заняли регистры XMM (common.c)
+	volatile u32int tlb_done;	// Поколение последнего выполненного сброса
+	volatile u32int need_resched;	// Вызвать schedule() при первой возможности
+	volatile u32int irq_nesting;	// Глубина вложенности IRQ, 0 - вне прерывания
+	volatile u32int softirq_pending;	// Бит n - работа n ждет выполнения (softirq.c)
+	u32int softirq_active;		// do_softirq() выполняет обработчики
+	u32int softirq_count[SOFTIRQ_MAX];	// Сколько раз выполнен каждый обработчик
+	// Последняя таблица, найденная get_page() (paging.c): каталог,
+	// номер таблицы, сама таблица и поколение table_gen
+	struct page_directory *walk_dir;
+	u32int walk_idx;
+	struct page_table *walk_table;
+	u32int walk_gen;
+	struct runqueue *rq;		// Очередь готовых задач (task.c)
+	u32int apic_id;
+	u32int stack;				// Вершина стека, на котором процессор стартовал
+	volatile u32int online;		// AP выставляет, закончив инициализацию
+	gdt_entry_t gdt[GDT_ENTRIES];
+	gdt_ptr_t gdt_ptr;
+	tss_entry_t tss;
+} cpu_t;
+
+// Число запущенных процессоров и их данные по номерам
+extern u32int smp_ncpus;
+extern cpu_t *cpus[SMP_MAX_CPUS];
+
+// Данные процессора, на котором запущено ядро
+extern cpu_t boot_cpu;
+
+/**
+ * Запускает остальные процессоры из таблицы MADT последовательностью
+ * INIT-SIPI-SIPI. Каждый получает свой стек, GDT, TSS и данные, а IDT
+ * у всех общая. Вызывается после init_apic() и init_tasking(); без
+ * APIC ничего не делает. Запущенные AP сразу начинают выполнять
+ * задачи. Возвращает число работающих процессоров.
+ */
+extern u32int init_smp();
+
+// Данные текущего процессора
+static inline cpu_t *this_cpu()
+{
+	cpu_t *cpu;
+	__asm__ volatile ("mov %%gs:0, %0" : "=r"(cpu));
+	return cpu;
+}
+
+// Номер текущего процессора
+static inline u32int smp_processor_id()
+{
+	u32int id;
+	__asm__ volatile ("mov %%gs:4, %0" : "=r"(id));
+	return id;
+}
+
+#endif
@@ -0,0 +1,53 @@
+// softirq.c -- Deferred interrupt work
+
+#include "softirq.h"
+#include "smp.h"
+
+static softirq_t softirq_handlers[SOFTIRQ_MAX];
+
+void register_softirq(u32int n, softirq_t handler)
+{
+	softirq_handlers[n] = handler;
+}
+
+u32int softirq_runs(u32int n)
+{
+	u32int i, runs = 0;
+	for (i = 0; i < smp_ncpus; ++i)
+		runs += cpus[i]->softirq_count[n];
+	return runs;
+}
+
+void raise_softirq(u32int n)
+{
+	__sync_fetch_and_or(&this_cpu()->softirq_pending, 0x1 << n);
+}
+
+void do_softirq()
+{
+	cpu_t *cpu = this_cpu();
+	u32int pending, n, restart = SOFTIRQ_RESTART;
+
+	// Прерывание пришло во время выполнения отложенной работы
+	if (cpu->softirq_active || !cpu->softirq_pending)
+		return;
+	cpu->softirq_active = 1;
+
+	while (restart-- && (pending = __sync_lock_test_and_set(&cpu->softirq_pending, 0)))
+	{
+		// Работа выполняется с разрешенными прерываниями:
+		// медленный обработчик больше не задерживает остальные IRQ
+		__asm__ volatile ("sti");
+		while (pending)
+		{
+			n = bsf(pending);
+			pending &= pending - 1;
+			if (softirq_handlers[n])
+				softirq_handlers[n]();
+			cpu->softirq_count[n]++;
+		}
+		__asm__ volatile ("cli");
+	}
+
+	cpu->softirq_active = 0;
+}
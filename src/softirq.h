@@ -0,0 +1,46 @@
+// softirq.h -- Deferred interrupt work
+
+#ifndef SOFTIRQ_H_
+#define SOFTIRQ_H_
+
+#include "common.h"
+
+// Номера отложенных обработчиков. Меньший номер выполняется раньше
+#define SOFTIRQ_TIMER	0
+#define SOFTIRQ_BENCH	31
+#define SOFTIRQ_MAX		32
+
+// Сколько раз do_softirq() перечитывает маску, прежде чем
+// оставить новые запросы до следующего прерывания
+#define SOFTIRQ_RESTART	10
+
+typedef void (*softirq_t)();
+
+/**
+ * Назначает обработчик отложенной работы с номером n
+ */
+extern void register_softirq(u32int n, softirq_t handler);
+
+/**
+ * Отмечает работу n как ожидающую. Вызывается из обработчика
+ * прерывания (верхней половины), который только обслужил
+ * устройство; сама работа будет выполнена при выходе из
+ * прерывания с разрешенными прерываниями на том же процессоре.
+ */
+extern void raise_softirq(u32int n);
+
+/**
+ * Выполняет ожидающую работу. Вызывается в конце irq_handler
+ * после EOI, с запрещенными прерываниями, и возвращает их
+ * запрещенными. Во вложенных прерываниях ничего не делает:
+ * поднятые ими запросы выполнит внешний вызов.
+ */
+extern void do_softirq();
+
+/**
+ * Статистика: сколько раз выполнялся обработчик n на всех
+ * процессорах. Счетчики у каждого процессора свои (cpu_t)
+ */
+extern u32int softirq_runs(u32int n);
+
+#endif
@@ -0,0 +1,49 @@
+// spinlock.c -- Lock contention statistics
+
+#include "spinlock.h"
+
+#ifdef LOCK_STATS
+#include "kprintf.h"
+
+// Все блокировки, которые брались хотя бы раз. Только растет
+static lock_stats_t *volatile lock_list = 0;
+
+// Счетчики меняет только владелец блокировки, поэтому атомарно
+// делается лишь добавление в список
+void lock_stats_acquired(lock_stats_t *stats, u32int spins)
+{
+	if (!stats->registered)
+	{
+		lock_stats_t *head;
+		stats->registered = 1;
+		do
+		{
+			head = lock_list;
+			stats->next = head;
+		} while (!__sync_bool_compare_and_swap(&lock_list, head, stats));
+	}
+	stats->acquired++;
+	if (spins)
+	{
+		stats->contended++;
+		stats->spins += spins;
+	}
+	stats->since = rdtsc();
+}
+
+void lock_stats_released(lock_stats_t *stats)
+{
+	u64int held = rdtsc() - stats->since;
+	if (held > stats->max_hold)
+		stats->max_hold = held >> 32 ? 0xFFFFFFFF : (u32int)held;
+}
+
+void dump_lock_stats()
+{
+	lock_stats_t *stats;
+	kprintf("lock              acquired  contended      spins   max hold\n");
+	for (stats = lock_list; stats; stats = stats->next)
+		kprintf("%-16s %9u %10u %10u %10u\n", stats->name ? stats->name : "?",
+			stats->acquired, stats->contended, stats->spins, stats->max_hold);
+}
+#endif
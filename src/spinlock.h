@@ -0,0 +1,265 @@
+// spinlock.h -- Spinlocks, ticket locks and reader-writer locks
+
+#ifndef SPINLOCK_H_
+#define SPINLOCK_H_
+
+#include "common.h"
+#include "preempt.h"
+
+// 'make LOCK_STATS=1' собирает ядро со счетчиками в каждой блокировке:
+// сколько раз она взята, сколько раз пришлось ждать, итерации ожидания
+// и самое долгое удержание. dump_lock_stats() выводит их
+#ifdef LOCK_STATS
+typedef struct lock_stats
+{
+	const char *name;
+	u32int acquired;			// Сколько раз взята
+	u32int contended;			// Из них была занята
+	u32int spins;				// Итераций ожидания всего
+	u32int max_hold;			// Самое долгое удержание, тактов
+	u64int since;				// TSC в момент захвата
+	u32int registered;			// Уже в списке для dump_lock_stats()
+	struct lock_stats *next;
+} lock_stats_t;
+
+#define LOCK_STATS_INIT(name)	, { name, 0, 0, 0, 0, 0, 0, 0 }
+
+extern void lock_stats_acquired(lock_stats_t *stats, u32int spins);
+extern void lock_stats_released(lock_stats_t *stats);
+
+/**
+ * Выводит счетчики всех блокировок, которые брались хотя бы раз
+ */
+extern void dump_lock_stats();
+
+#define lock_stat_acquired(stats, spins)	lock_stats_acquired(stats, spins)
+#define lock_stat_released(stats)			lock_stats_released(stats)
+#else
+#define LOCK_STATS_INIT(name)
+#define lock_stat_acquired(stats, spins)	((void)(spins))
+#define lock_stat_released(stats)			((void)0)
+#endif
+
+// Defined in smp.c and paging.c
+extern u32int smp_ncpus;
+extern void tlb_flush_requested();
+
+/**
+ * Пауза в цикле ожидания. Ждущий с выключенными прерываниями не примет
+ * IPI сброса TLB, а запросивший его процессор может держать как раз
+ * ту блокировку, которую мы ждем: поэтому запрос (cpu_t.tlb_pending,
+ * %gs:20) выполняется прямо здесь. До запуска AP gs может быть еще
+ * не настроен, но и запросов тогда нет
+ */
+static inline void lock_relax()
+{
+	u32int pending;
+	cpu_relax();
+	if (smp_ncpus > 1)
+	{
+		__asm__ volatile ("mov %%gs:20, %0" : "=r"(pending));
+		if (pending)
+			tlb_flush_requested();
+	}
+}
+
+static inline u32int irq_save()
+{
+	u32int flags;
+	__asm__ volatile ("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+	return flags;
+}
+
+static inline void irq_restore(u32int flags)
+{
+	__asm__ volatile ("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+/**
+ * Простая блокировка: test-and-test-and-set. Ожидающие крутятся на
+ * чтении своей копии строки кэша и пробуют xchg, только когда
+ * блокировка освободилась. Порядок захвата не гарантирован
+ */
+typedef struct spinlock
+{
+	volatile u32int locked;
+#ifdef LOCK_STATS
+	lock_stats_t stats;
+#endif
+} spinlock_t;
+
+#define SPINLOCK_INIT(name)		{ 0 LOCK_STATS_INIT(name) }
+
+static inline void spin_acquire(spinlock_t *lock)
+{
+	u32int spins = 0;
+	while (__sync_lock_test_and_set(&lock->locked, 1))
+		while (lock->locked)
+		{
+			lock_relax();
+			spins++;
+		}
+	lock_stat_acquired(&lock->stats, spins);
+}
+
+static inline void spin_release(spinlock_t *lock)
+{
+	lock_stat_released(&lock->stats);
+	__sync_lock_release(&lock->locked);
+}
+
+/**
+ * Берет блокировку, запретив вытеснение: задача, которая ее держит,
+ * не уступит процессор ожидающим. Данные, которые трогают обработчики
+ * прерываний, защищаются spin_lock_irqsave()
+ */
+static inline void spin_lock(spinlock_t *lock)
+{
+	preempt_disable();
+	spin_acquire(lock);
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+	spin_release(lock);
+	preempt_enable();
+}
+
+/**
+ * Берет блокировку с запрещенными прерываниями и возвращает прежнее
+ * состояние флагов для spin_unlock_irqrestore(). Вытеснение при этом
+ * невозможно и без preempt_count
+ */
+static inline u32int spin_lock_irqsave(spinlock_t *lock)
+{
+	u32int flags = irq_save();
+	spin_acquire(lock);
+	return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, u32int flags)
+{
+	spin_release(lock);
+	irq_restore(flags);
+}
+
+/**
+ * Билетная блокировка: каждый ожидающий берет номер (xadd) и ждет,
+ * пока его не вызовут. Процессоры получают ее строго в порядке
+ * очереди - никто не ждет бесконечно, сколько бы их ни было
+ */
+typedef struct ticketlock
+{
+	volatile u16int next;		// Номер, который получит следующий
+	volatile u16int owner;		// Номер того, кто держит блокировку
+#ifdef LOCK_STATS
+	lock_stats_t stats;
+#endif
+} ticketlock_t;
+
+#define TICKETLOCK_INIT(name)	{ 0, 0 LOCK_STATS_INIT(name) }
+
+static inline void ticket_acquire(ticketlock_t *lock)
+{
+	u16int ticket = __sync_fetch_and_add(&lock->next, 1);
+	u32int spins = 0;
+	while (lock->owner != ticket)
+	{
+		lock_relax();
+		spins++;
+	}
+	lock_stat_acquired(&lock->stats, spins);
+}
+
+static inline void ticket_release(ticketlock_t *lock)
+{
+	lock_stat_released(&lock->stats);
+	// Пишет только владелец; запись на x86 не обгонит предыдущие
+	__asm__ volatile ("" : : : "memory");
+	lock->owner++;
+}
+
+static inline void ticket_lock(ticketlock_t *lock)
+{
+	preempt_disable();
+	ticket_acquire(lock);
+}
+
+static inline void ticket_unlock(ticketlock_t *lock)
+{
+	ticket_release(lock);
+	preempt_enable();
+}
+
+static inline u32int ticket_lock_irqsave(ticketlock_t *lock)
+{
+	u32int flags = irq_save();
+	ticket_acquire(lock);
+	return flags;
+}
+
+static inline void ticket_unlock_irqrestore(ticketlock_t *lock, u32int flags)
+{
+	ticket_release(lock);
+	irq_restore(flags);
+}
+
+/**
+ * Блокировка читателей и писателей. readers - число читателей или -1,
+ * пока блокировку держит писатель. Ожидающий писатель не пускает
+ * новых читателей, иначе при постоянном чтении он бы не дождался.
+ * Счетчики LOCK_STATS относятся только к писателям
+ */
+typedef struct rwlock
+{
+	volatile s32int readers;
+	volatile u32int writers_waiting;
+#ifdef LOCK_STATS
+	lock_stats_t stats;
+#endif
+} rwlock_t;
+
+#define RWLOCK_INIT(name)		{ 0, 0 LOCK_STATS_INIT(name) }
+
+static inline void read_lock(rwlock_t *lock)
+{
+	s32int n;
+	preempt_disable();
+	for (;;)
+	{
+		while (lock->writers_waiting || (n = lock->readers) < 0)
+			lock_relax();
+		if (__sync_bool_compare_and_swap(&lock->readers, n, n + 1))
+			break;
+	}
+}
+
+static inline void read_unlock(rwlock_t *lock)
+{
+	__sync_fetch_and_sub(&lock->readers, 1);
+	preempt_enable();
+}
+
+static inline void write_lock(rwlock_t *lock)
+{
+	u32int spins = 0;
+	preempt_disable();
+	__sync_fetch_and_add(&lock->writers_waiting, 1);
+	while (lock->readers || !__sync_bool_compare_and_swap(&lock->readers, 0, -1))
+	{
+		lock_relax();
+		spins++;
+	}
+	__sync_fetch_and_sub(&lock->writers_waiting, 1);
+	lock_stat_acquired(&lock->stats, spins);
+}
+
+static inline void write_unlock(rwlock_t *lock)
+{
+	lock_stat_released(&lock->stats);
+	__asm__ volatile ("" : : : "memory");
+	lock->readers = 0;
+	preempt_enable();
+}
+
+#endif
@@ -0,0 +1,24 @@
+; switch.s -- Switching kernel stacks between tasks
+
+[GLOBAL switch_to]
+
+; void switch_to(u32int *prev_esp, u32int next_esp)
+; Сохраняет регистры, которые вызываемая функция обязана сохранить,
+; в стеке текущей задачи, запоминает ее esp и продолжает выполнение
+; на стеке следующей. Возврат происходит уже в следующую задачу.
+switch_to:
+	mov eax, [esp+4]		; prev_esp
+	mov edx, [esp+8]		; next_esp
+
+	push ebp
+	push ebx
+	push esi
+	push edi
+	mov [eax], esp
+
+	mov esp, edx
+	pop edi
+	pop esi
+	pop ebx
+	pop ebp
+	ret
@@ -0,0 +1,492 @@
+// task.c -- Kernel tasks and the scheduler
+
+#include "task.h"
+#include "kheap.h"
+#include "isr.h"
+#include "apic.h"
+#include "clock.h"
+#include "wsq.h"
+
+u32int task_timeslice = TASK_TIMESLICE;
+u32int task_cpus = SMP_MAX_CPUS;
+
+// Очередь готовых задач процессора: дек на каждый приоритет и битовая
+// карта непустых деков. Следующая задача - первая в деке с младшим
+// установленным битом, выбор за O(1). Кладет в деки только владелец
+// (с выключенными прерываниями), забирают все процессоры: простаивающие
+// воруют из самой длинной очереди. Другие процессоры ставят задачи
+// во входящий стек, который владелец переносит в деки сам.
+typedef struct runqueue
+{
+	wsq_t queue[TASK_PRIORITIES];
+	u32int bitmap;				// Меняет только владелец; для остальных - подсказка
+	volatile u32int nr_ready;	// Задач в деках и во входящем стеке
+	task_t *volatile inbox;
+	task_t *idle;				// Выполняется, когда готовых задач нет
+	task_t *prev;				// Задача, с которой только что переключились
+	u32int balance_ticks;
+} runqueue_t;
+
+static u32int next_id = 0;
+
+// Процессоры, остановленные в hlt в ожидании работы
+static volatile u32int idle_mask = 0;
+
+// Балансировка не трогает задачи, снятые с процессора позже
+static u32int cache_hot_cycles;
+
+// Defined in switch.s
+extern void switch_to(u32int *prev_esp, u32int next_esp);
+
+static inline u32int sched_cpus()
+{
+	return task_cpus < smp_ncpus ? task_cpus : smp_ncpus;
+}
+
+static runqueue_t *rq_alloc()
+{
+	runqueue_t *rq = (runqueue_t*)kmalloc(sizeof(runqueue_t));
+	u32int i;
+
+	memset(rq, 0, sizeof(runqueue_t));
+	for (i = 0; i < TASK_PRIORITIES; ++i)
+		wsq_init(&rq->queue[i], TASK_QUEUE_SIZE);
+	return rq;
+}
+
+// Входящий стек: класть может любой процессор, забирает весь
+// стек разом владелец
+static void inbox_push(runqueue_t *rq, task_t *task)
+{
+	task_t *head;
+	do
+	{
+		head = rq->inbox;
+		task->next = head;
+	} while (!__sync_bool_compare_and_swap(&rq->inbox, head, task));
+}
+
+// Кладет задачу в свой дек. Только для владельца очереди
+static int rq_push(runqueue_t *rq, task_t *task)
+{
+	if (!wsq_push(&rq->queue[task->priority], task))
+		return 0;
+	rq->bitmap |= 0x1 << task->priority;
+	return 1;
+}
+
+// Переносит задачи, поставленные другими процессорами, в свои деки.
+// Не поместившиеся остаются во входящем стеке
+static void rq_drain_inbox(runqueue_t *rq)
+{
+	task_t *list, *prev = 0, *next;
+
+	if (!rq->inbox)
+		return;
+	list = __sync_lock_test_and_set(&rq->inbox, 0);
+	// Стек хранит задачи в обратном порядке
+	while (list)
+	{
+		next = list->next;
+		list->next = prev;
+		prev = list;
+		list = next;
+	}
+	for (; prev; prev = next)
+	{
+		next = prev->next;
+		if (!rq_push(rq, prev))
+			inbox_push(rq, prev);
+	}
+}
+
+// Есть ли в очереди задачи, которые можно забрать
+static int rq_stealable(runqueue_t *rq)
+{
+	u32int bitmap = rq->bitmap;
+	while (bitmap)
+	{
+		u32int prio = bsf(bitmap);
+		if (wsq_size(&rq->queue[prio]))
+			return 1;
+		bitmap &= ~(0x1 << prio);
+	}
+	return 0;
+}
+
+// Будит простаивающий процессор, лучше всего target, чтобы он забрал
+// задачу. Бит в idle_mask снимает тот, кто будит: каждый процессор
+// получает одно прерывание, сколько бы задач ни появилось
+static void kick_idle(u32int target)
+{
+	u32int mask = idle_mask & ((0x1 << sched_cpus()) - 1), cpu;
+
+	if (!mask)
+		return;
+	cpu = (mask & (0x1 << target)) ? target : bsf(mask);
+	if (__sync_fetch_and_and(&idle_mask, ~(0x1 << cpu)) & (0x1 << cpu))
+		apic_send_ipi(cpus[cpu]->apic_id, IRQ_RESCHED);
+}
+
+// Процессор для задачи, которая стала готовой. Предпочитаем тот, на
+// котором она работала: там ее данные в кэше. Если его очередь заметно
+// длиннее нашей, задача остается здесь.
+static u32int select_cpu(cpu_t *self, task_t *task)
+{
+	u32int cpu = task->last_cpu;
+
+	if (cpu >= sched_cpus() || cpus[cpu]->rq->nr_ready > self->rq->nr_ready + TASK_IMBALANCE)
+		cpu = self->id;
+	return cpu;
+}
+
+// Ставит готовую задачу в очередь. Прерывания выключены
+static void task_enqueue(task_t *task)
+{
+	cpu_t *self = this_cpu();
+	u32int target = select_cpu(self, task), priority = task->priority;
+	runqueue_t *rq = cpus[target]->rq;
+
+	// Из очереди задачу может сразу забрать другой процессор:
+	// после этого ее поля уже не наши
+	__sync_fetch_and_add(&rq->nr_ready, 1);
+	if (target != self->id || !rq_push(rq, task))
+		inbox_push(rq, task);
+	if (target == self->id && priority < self->current->priority)
+		self->need_resched = 1;
+	kick_idle(target);
+}
+
+// Забирает задачу из самой длинной чужой очереди. Если cold, только
+// задачу, которая давно не выполнялась: горячую возвращаем владельцу
+static task_t *steal_task(cpu_t *self, int cold)
+{
+	u32int i, n = sched_cpus(), max = 0, bitmap;
+	cpu_t *victim = 0;
+	task_t *task;
+
+	for (i = 0; i < n; ++i)
+	{
+		if (i != self->id && cpus[i]->rq->nr_ready > max)
+		{
+			max = cpus[i]->rq->nr_ready;
+			victim = cpus[i];
+		}
+	}
+	if (!victim || (cold && max <= self->rq->nr_ready + TASK_IMBALANCE))
+		return 0;
+
+	// С верхнего конца дека берется задача, дольше всех ждавшая
+	// в очереди, - наименее вероятно, что ее данные еще в кэше
+	bitmap = victim->rq->bitmap;
+	while (bitmap)
+	{
+		u32int prio = bsf(bitmap);
+		if ((task = (task_t*)wsq_steal(&victim->rq->queue[prio])))
+		{
+			if (cold && rdtsc() - task->last_ran < cache_hot_cycles)
+			{
+				inbox_push(victim->rq, task);
+				return 0;
+			}
+			__sync_fetch_and_sub(&victim->rq->nr_ready, 1);
+			return task;
+		}
+		bitmap &= ~(0x1 << prio);
+	}
+	return 0;
+}
+
+// Следующая задача для процессора. prev еще не в очереди: она
+// продолжает работу, если готовых задач ее приоритета нет
+static task_t *pick_next(cpu_t *cpu, task_t *prev)
+{
+	runqueue_t *rq = cpu->rq;
+	int keep = prev->state == TASK_RUNNING && prev != rq->idle;
+	task_t *next;
+
+	rq_drain_inbox(rq);
+	while (rq->bitmap)
+	{
+		u32int prio = bsf(rq->bitmap);
+		if (keep && prev->priority < prio)
+			return prev;
+		if ((next = (task_t*)wsq_steal(&rq->queue[prio])))
+		{
+			__sync_fetch_and_sub(&rq->nr_ready, 1);
+			return next;
+		}
+		// Дек мог опустеть, а мог проиграть гонку с вором
+		if (!wsq_size(&rq->queue[prio]))
+			rq->bitmap &= ~(0x1 << prio);
+	}
+	if (keep)
+		return prev;
+	if (cpu->id < sched_cpus() && (next = steal_task(cpu, 0)))
+		return next;
+	return rq->idle;
+}
+
+// Выполняется в новой задаче сразу после переключения на нее. Только
+// теперь стек prev сохранен, и ее можно ставить в очередь, откуда ее
+// заберет другой процессор, или освобождать
+static void finish_switch()
+{
+	runqueue_t *rq = this_cpu()->rq;
+	task_t *prev = rq->prev;
+
+	rq->prev = 0;
+	if (!prev)
+		return;
+	if (prev->state == TASK_DEAD)
+	{
+		if (prev->stack)
+			kfree((void*)prev->stack);
+		kfree(prev);
+	}
+	else
+	{
+		// Состояние читаем до того, как снять on_cpu: после этого
+		// заблокированную задачу может поставить в очередь task_wake()
+		int running = prev->state == TASK_RUNNING;
+		__sync_lock_release(&prev->on_cpu);
+		if (running && prev != rq->idle)
+		{
+			prev->slice = task_timeslice;
+			__sync_fetch_and_add(&rq->nr_ready, 1);
+			if (!rq_push(rq, prev))
+				inbox_push(rq, prev);
+		}
+	}
+}
+
+// С этого адреса начинает работу каждая новая задача
+static void task_start()
+{
+	finish_switch();
+	__asm__ volatile ("sti");
+	current_task->fn(current_task->arg);
+	task_exit();
+}
+
+static task_t *task_alloc(char *name, task_fn fn, void *arg, u32int priority)
+{
+	task_t *task = (task_t*)kmalloc(sizeof(task_t));
+
+	memset(task, 0, sizeof(task_t));
+	task->id = __sync_fetch_and_add(&next_id, 1);
+	task->state = TASK_RUNNING;
+	task->priority = priority < TASK_PRIORITIES ? priority : TASK_PRIORITIES - 1;
+	task->slice = task_timeslice;
+	task->dir = kernel_directory;
+	task->fn = fn;
+	task->arg = arg;
+	task->name = name;
+	return task;
+}
+
+// Стек выглядит так, будто задача остановилась в switch_to():
+// четыре сохраненных регистра и адрес возврата в task_start
+static void task_alloc_stack(task_t *task)
+{
+	u32int *sp;
+
+	task->stack = kmalloc(TASK_STACK_SIZE);
+	sp = (u32int*)(task->stack + TASK_STACK_SIZE);
+	*--sp = (u32int)&task_start;
+	*--sp = 0;	// ebp
+	*--sp = 0;	// ebx
+	*--sp = 0;	// esi
+	*--sp = 0;	// edi
+	task->esp = (u32int)sp;
+}
+
+// Может ли процессор забрать задачу у другого
+static int work_to_steal(cpu_t *self)
+{
+	u32int i, n = sched_cpus();
+
+	if (self->id >= n)
+		return 0;
+	for (i = 0; i < n; ++i)
+		if (i != self->id && rq_stealable(cpus[i]->rq))
+			return 1;
+	return 0;
+}
+
+// Цикл задачи idle. Бит в idle_mask выставляется до последней
+// проверки очередей, а задачи ставятся в очередь до чтения idle_mask:
+// процессор не уснет, пропустив работу. sti; hlt не пропускает
+// прерывание, пришедшее между ними
+static void idle_loop(void *arg)
+{
+	cpu_t *cpu = this_cpu();
+	u32int bit = 0x1 << cpu->id;
+
+	for (;;)
+	{
+		__asm__ volatile ("cli");
+		schedule();
+
+		__sync_fetch_and_or(&idle_mask, bit);
+		if (!cpu->rq->nr_ready && !work_to_steal(cpu))
+			__asm__ volatile ("sti; hlt");
+		__sync_fetch_and_and(&idle_mask, ~bit);
+	}
+}
+
+static void resched_ipi(registers_t *regs)
+{
+	this_cpu()->need_resched = 1;
+}
+
+static void lapic_timer_tick(registers_t *regs)
+{
+	task_tick();
+}
+
+void init_tasking()
+{
+	task_t *task = task_alloc("main", 0, 0, TASK_PRIORITY_DEFAULT);
+
+	cache_hot_cycles = tsc_khz * TASK_CACHE_HOT_US / 1000;
+	register_interrupt_handler(IRQ_RESCHED, &resched_ipi);
+	register_interrupt_handler(IRQ_LAPIC_TIMER, &lapic_timer_tick);
+
+	boot_cpu.rq = rq_alloc();
+	boot_cpu.rq->idle = task_alloc("idle", &idle_loop, 0, TASK_PRIORITIES - 1);
+	task_alloc_stack(boot_cpu.rq->idle);
+	task->dir = current_directory;
+	task->on_cpu = 1;
+	boot_cpu.current = task;
+}
+
+void task_init_cpu(cpu_t *cpu)
+{
+	cpu->rq = rq_alloc();
+	cpu->rq->idle = task_alloc("idle", 0, 0, TASK_PRIORITIES - 1);
+	cpu->rq->idle->last_cpu = cpu->id;
+	cpu->rq->idle->on_cpu = 1;
+	cpu->current = cpu->rq->idle;
+}
+
+void task_idle()
+{
+	idle_loop(0);
+}
+
+task_t *task_create(char *name, task_fn fn, void *arg, u32int priority)
+{
+	task_t *task = task_alloc(name, fn, arg, priority);
+	u32int flags;
+
+	task_alloc_stack(task);
+	flags = irq_save();
+	task->last_cpu = smp_processor_id();
+	task_enqueue(task);
+	irq_restore(flags);
+	return task;
+}
+
+void schedule()
+{
+	u32int flags = irq_save();
+	cpu_t *cpu = this_cpu();
+	task_t *prev = cpu->current, *next;
+
+	cpu->need_resched = 0;
+	next = pick_next(cpu, prev);
+	if (next == prev)
+	{
+		// Задача продолжает работу с новым квантом, иначе task_tick()
+		// больше не отсчитывал бы его и не вытеснил бы ее
+		prev->slice = task_timeslice;
+		irq_restore(flags);
+		return;
+	}
+
+	// Процессор проснулся и занят: будить его больше не нужно
+	if (prev == cpu->rq->idle && (idle_mask & (0x1 << cpu->id)))
+		__sync_fetch_and_and(&idle_mask, ~(0x1 << cpu->id));
+	prev->last_ran = rdtsc();
+	next->last_cpu = cpu->id;
+	next->on_cpu = 1;
+	cpu->rq->prev = prev;
+	cpu->current = next;
+	switch_page_directory(next->dir);
+	switch_to(&prev->esp, next->esp);
+
+	// Сюда задача prev возвращается, когда до нее снова дойдет очередь,
+	// возможно, уже на другом процессоре
+	finish_switch();
+	irq_restore(flags);
+}
+
+void task_yield()
+{
+	schedule();
+}
+
+int task_wake(task_t *task)
+{
+	u32int flags;
+
+	// Будит только один: остальные увидят TASK_WAKING
+	if (!__sync_bool_compare_and_swap(&task->state, TASK_BLOCKED, TASK_WAKING))
+		return 0;
+	// Задача могла еще не дойти до switch_to() на своем процессоре:
+	// ставить ее в очередь можно, только когда ее стек сохранен.
+	// Ждать недолго - она уже в schedule() с выключенными прерываниями
+	while (task->on_cpu)
+		lock_relax();
+	task->state = TASK_RUNNING;
+	flags = irq_save();
+	task_enqueue(task);
+	irq_restore(flags);
+	return 1;
+}
+
+void task_exit()
+{
+	__asm__ volatile ("cli");
+	current_task->state = TASK_DEAD;
+	schedule();
+}
+
+void task_tick()
+{
+	cpu_t *cpu = this_cpu();
+	runqueue_t *rq = cpu->rq;
+	task_t *task = cpu->current, *stolen;
+
+	if (!rq)
+		return;
+	if (task != rq->idle && task->slice && !--task->slice)
+		cpu->need_resched = 1;
+
+	// Периодическая балансировка: своя очередь заметно короче
+	// самой длинной - забираем из нее одну задачу
+	if (++rq->balance_ticks < TASK_BALANCE_TICKS || cpu->id >= sched_cpus())
+		return;
+	rq->balance_ticks = 0;
+	if ((stolen = steal_task(cpu, 1)))
+	{
+		__sync_fetch_and_add(&rq->nr_ready, 1);
+		if (!rq_push(rq, stolen))
+			inbox_push(rq, stolen);
+		if (task == rq->idle || stolen->priority < task->priority)
+			cpu->need_resched = 1;
+	}
+}
+
+void preempt_enable()
+{
+	cpu_t *cpu;
+
+	__asm__ volatile ("decl %%gs:12" : : : "memory");
+	// Квант мог кончиться, пока вытеснение было запрещено. В обработчике
+	// прерывания не переключаемся: это сделает выход из прерывания
+	cpu = this_cpu();
+	if (!cpu->preempt_count && cpu->need_resched && !cpu->irq_nesting)
+		schedule();
+}
@@ -0,0 +1,130 @@
+// task.h -- Kernel tasks and the scheduler
+
+#ifndef TASK_H_
+#define TASK_H_
+
+#include "common.h"
+#include "paging.h"
+#include "smp.h"
+#include "preempt.h"
+
+// Приоритеты 0 (высший) .. TASK_PRIORITIES-1
+#define TASK_PRIORITIES		32
+#define TASK_PRIORITY_DEFAULT	16
+
+#define TASK_STACK_SIZE		0x2000
+// Квант по умолчанию, в тиках таймера
+#define TASK_TIMESLICE		5
+
+// Емкость дека одного приоритета в очереди процессора
+#define TASK_QUEUE_SIZE		128
+// Раз в столько тиков процессор сравнивает свою очередь с самой
+// длинной и забирает из нее задачу, если разница больше TASK_IMBALANCE
+#define TASK_BALANCE_TICKS	4
+#define TASK_IMBALANCE		1
+// Задачу, снятую с процессора меньше этого времени назад, балансировка
+// не переносит: ее данные, скорее всего, еще в кэше
+#define TASK_CACHE_HOT_US	500
+
+// Состояния задачи
+#define TASK_RUNNING		0	// Выполняется или стоит в очереди
+#define TASK_BLOCKED		1	// Ждет task_wake(), см. wait.h
+#define TASK_DEAD			2
+#define TASK_WAKING			3	// task_wake() ждет, пока задача уйдет с процессора
+
+typedef void (*task_fn)(void *arg);
+
+typedef struct task
+{
+	u32int esp;				// Сохраненный указатель стека ядра
+	u32int id;
+	volatile u32int state;
+	u32int priority;
+	u32int slice;			// Сколько тиков кванта осталось
+	page_directory_t *dir;
+	u32int stack;			// Начало стека ядра, 0 - стек загрузчика
+	task_fn fn;
+	void *arg;
+	char *name;
+	u32int last_cpu;		// Где задача выполнялась последний раз
+	u64int last_ran;		// TSC в момент, когда ее сняли с процессора
+	volatile u32int on_cpu;	// Выполняется, или ее стек еще не сохранен
+	struct task *next;		// Следующая во входящей очереди процессора
+	struct task *wait_next;	// Следующая в очереди ожидания (wait.c)
+} task_t;
+
+// Задача, выполняемая на текущем процессоре: одно чтение через gs
+static inline task_t *get_current_task()
+{
+	task_t *task;
+	__asm__ volatile ("mov %%gs:8, %0" : "=r"(task));
+	return task;
+}
+#define current_task get_current_task()
+
+// Длина кванта в тиках, можно менять на ходу
+extern u32int task_timeslice;
+
+// Задачи выполняются на процессорах с номерами меньше этого
+// (и меньше smp_ncpus), остальные простаивают
+extern u32int task_cpus;
+
+/**
+ * Делает выполняющийся код (kmain) задачей "main" с приоритетом
+ * по умолчанию. После этого таймер начинает вытеснять задачи.
+ */
+extern void init_tasking();
+
+/**
+ * Создает очередь задач процессора cpu. Вызывается на BSP до запуска
+ * AP; код, с которого AP стартует, становится его задачей idle
+ */
+extern void task_init_cpu(cpu_t *cpu);
+
+/**
+ * Цикл простоя AP: выполняет задачи, а когда их нет - hlt.
+ * Не возвращается
+ */
+extern void task_idle();
+
+/**
+ * Создает задачу, которая выполнит fn(arg) на собственном стеке
+ * ядра в адресном пространстве ядра, и ставит ее в очередь.
+ * Возврат из fn завершает задачу.
+ */
+extern task_t *task_create(char *name, task_fn fn, void *arg, u32int priority);
+
+/**
+ * Отдает процессор следующей готовой задаче того же или более
+ * высокого приоритета
+ */
+extern void task_yield();
+
+/**
+ * Делает заблокированную задачу (TASK_BLOCKED) снова готовой и ставит
+ * ее в очередь. Возвращает 0, если задача не была заблокирована или
+ * ее уже будит кто-то другой. Можно вызывать из прерывания.
+ */
+extern int task_wake(task_t *task);
+
+/**
+ * Завершает текущую задачу. Ее стек освобождается после переключения.
+ */
+extern void task_exit();
+
+/**
+ * Выбирает следующую задачу и переключается на нее. Текущая, если
+ * она не заблокирована, встает в конец очереди своего приоритета.
+ * Когда своя очередь пуста, задача забирается из самой длинной
+ * очереди другого процессора.
+ */
+extern void schedule();
+
+/**
+ * Учитывает тик в кванте текущей задачи и время от времени
+ * выравнивает очереди процессоров. Вызывается из прерывания
+ * таймера каждого процессора.
+ */
+extern void task_tick();
+
+#endif
@@ -1,24 +1,195 @@
 #include "timer.h"
 #include "isr.h"
-#include "monitor.h"
+#include "klog.h"
+#include "softirq.h"
+#include "clock.h"
+#include "task.h"
+#include "spinlock.h"
 
-static u32int tick = 0;
+static volatile u32int tick = 0;
+static u32int period_ns = 0;
 
-static void timer_callback(registers_t regs)
+// Иерархическое колесо таймеров. Первый уровень - 256 списков,
+// по одному на каждый из ближайших тиков; каждый следующий из 64
+// списков покрывает в 64 раза больший промежуток. Таймеры верхних
+// уровней переносятся на уровень ниже, когда до них доходит очередь,
+// так что взвод и снятие таймера - O(1), а на тик приходится
+// один перенос одного списка не чаще раза в 256 тиков.
+#define TVR_BITS	8
+#define TVN_BITS	6
+#define TVR_SIZE	(0x1 << TVR_BITS)
+#define TVN_SIZE	(0x1 << TVN_BITS)
+#define TVR_MASK	(TVR_SIZE - 1)
+#define TVN_MASK	(TVN_SIZE - 1)
+#define TVN_LEVELS	4
+
+static ktimer_t *tv1[TVR_SIZE];
+static ktimer_t *tvn[TVN_LEVELS][TVN_SIZE];
+// Следующий тик, который колесо еще не обработало
+static u32int wheel_tick = 0;
+
+u32int timer_expired = 0;
+u64int timer_run_cycles = 0;
+
+// Колесо меняют задачи на всех процессорах и softirq таймера на BSP
+static spinlock_t wheel_spinlock = SPINLOCK_INIT("timer wheel");
+
+static inline u32int wheel_lock()
+{
+	return spin_lock_irqsave(&wheel_spinlock);
+}
+
+static inline void wheel_unlock(u32int flags)
+{
+	spin_unlock_irqrestore(&wheel_spinlock, flags);
+}
+
+static void list_add(ktimer_t **head, ktimer_t *timer)
+{
+	timer->next = *head;
+	if (*head)
+		(*head)->pprev = &timer->next;
+	timer->pprev = head;
+	*head = timer;
+}
+
+static void list_del(ktimer_t *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->pprev = 0;
+}
+
+// Помещает таймер в список, соответствующий его сроку
+static void internal_add(ktimer_t *timer)
+{
+	u32int expires = timer->expires;
+	u32int idx = expires - wheel_tick;
+	u32int level;
+
+	if ((s32int)idx < 0)
+	{
+		// Срок уже прошел - сработает на ближайшем тике
+		list_add(&tv1[wheel_tick & TVR_MASK], timer);
+		return;
+	}
+	if (idx < TVR_SIZE)
+	{
+		list_add(&tv1[expires & TVR_MASK], timer);
+		return;
+	}
+	for (level = 0; level < TVN_LEVELS - 1; ++level)
+		if (idx < (0x1U << (TVR_BITS + (level + 1)*TVN_BITS)))
+			break;
+	list_add(&tvn[level][(expires >> (TVR_BITS + level*TVN_BITS)) & TVN_MASK], timer);
+}
+
+// Переносит таймеры из списка index уровня level на уровни ниже.
+// Возвращает index: ноль значит, что пора переносить и следующий уровень
+static u32int cascade(u32int level, u32int index)
+{
+	ktimer_t *timer = tvn[level][index], *next;
+	tvn[level][index] = 0;
+	for (; timer; timer = next)
+	{
+		next = timer->next;
+		internal_add(timer);
+	}
+	return index;
+}
+
+#define INDEX(level) ((wheel_tick >> (TVR_BITS + (level)*TVN_BITS)) & TVN_MASK)
+
+// Обрабатывает все тики до текущего: запускает сработавшие таймеры
+static void run_timers()
+{
+	u64int start = rdtsc();
+	u32int flags = wheel_lock();
+
+	while ((s32int)(tick - wheel_tick) >= 0)
+	{
+		u32int index = wheel_tick & TVR_MASK;
+		u32int level;
+		ktimer_t *timer;
+
+		// Первый уровень пройден по кругу - спускаем следующий список сверху
+		if (!index)
+			for (level = 0; level < TVN_LEVELS && !cascade(level, INDEX(level)); ++level)
+				;
+		++wheel_tick;
+
+		// Таймеры снимаем по одному: обработчик может снять
+		// или взвести другие таймеры
+		while ((timer = tv1[index]))
+		{
+			ktimer_fn fn = timer->fn;
+			void *arg = timer->arg;
+			list_del(timer);
+			timer_expired++;
+			wheel_unlock(flags);
+			fn(arg);
+			flags = wheel_lock();
+		}
+	}
+
+	wheel_unlock(flags);
+	timer_run_cycles += rdtsc() - start;
+}
+
+static void timer_callback(registers_t *regs)
 {
 	tick++;
-	monitor_write("Tick: ");
-	monitor_write_dec(tick);
-	monitor_write("\n");
+	clock_tick(period_ns);
+	task_tick();
+	raise_softirq(SOFTIRQ_TIMER);
+}
+
+// Отложенная часть: таймеры и вывод консоли выполняются
+// уже с разрешенными прерываниями
+static void timer_softirq()
+{
+	run_timers();
+	klog_drain();
+}
+
+void timer_setup(ktimer_t *timer, ktimer_fn fn, void *arg)
+{
+	timer->next = 0;
+	timer->pprev = 0;
+	timer->fn = fn;
+	timer->arg = arg;
+}
+
+void timer_add(ktimer_t *timer, u32int ticks)
+{
+	u32int flags = wheel_lock();
+	if (timer->pprev)
+		list_del(timer);
+	timer->expires = tick + ticks;
+	internal_add(timer);
+	wheel_unlock(flags);
+}
+
+int timer_cancel(ktimer_t *timer)
+{
+	u32int flags = wheel_lock();
+	int pending = timer->pprev != 0;
+	if (pending)
+		list_del(timer);
+	wheel_unlock(flags);
+	return pending;
 }
 
 void init_timer(u32int freq)
 {
 	// Для начала регистрируем наш callback
 	register_interrupt_handler(IRQ0,&timer_callback);
+	register_softirq(SOFTIRQ_TIMER, &timer_softirq);
 
 	// Значение, сообщаемое в PIT
 	u32int divisor = 1193180 / freq;
+	period_ns = 1000000000 / freq;
 
 	// Послать команду
 	outb(0x43,0x36);
@@ -31,3 +202,8 @@ void init_timer(u32int freq)
 	outb(0x40,l);
 	outb(0x40,h);
 }
+
+u32int timer_ticks()
+{
+	return tick;
+}
@@ -6,7 +6,52 @@
 
 #include "common.h"
 
+// Частота тиков, с которой kmain запускает таймер
+#define TIMER_HZ 100
+
+typedef void (*ktimer_fn)(void *arg);
+
+// Таймер ядра. Память под него выделяет владелец, колесо
+// таймеров только связывает таймеры в списки
+typedef struct ktimer
+{
+	struct ktimer *next;
+	struct ktimer **pprev;	// 0 - таймер не взведен
+	u32int expires;			// Тик, на котором сработает
+	ktimer_fn fn;
+	void *arg;
+} ktimer_t;
+
 extern void init_timer(u32int freq);
 
-#endif
+// Число тиков с момента init_timer()
+extern u32int timer_ticks();
+
+/**
+ * Готовит таймер к использованию: fn(arg) будет вызвана по его
+ * срабатыванию в отложенном контексте (softirq, прерывания разрешены)
+ */
+extern void timer_setup(ktimer_t *timer, ktimer_fn fn, void *arg);
 
+/**
+ * Взводит таймер на ticks тиков от текущего момента. Уже взведенный
+ * таймер переставляется. O(1).
+ */
+extern void timer_add(ktimer_t *timer, u32int ticks);
+
+/**
+ * Снимает таймер. Возвращает 1, если он был взведен. O(1).
+ */
+extern int timer_cancel(ktimer_t *timer);
+
+static inline int timer_pending(ktimer_t *timer)
+{
+	return timer->pprev != 0;
+}
+
+// Статистика колеса: сработавшие таймеры и такты, проведенные
+// в их обработке (включая перенос между уровнями)
+extern u32int timer_expired;
+extern u64int timer_run_cycles;
+
+#endif
@@ -0,0 +1,63 @@
+; trampoline.s -- Startup code for application processors
+; smp.c copies it to SMP_TRAMPOLINE (0x8000) and sends each AP a SIPI
+; with vector 0x08: the AP starts at 0800:0000 in real mode. The code
+; runs from the copy, so every address is computed relative to 0x8000.
+
+%define TRAMPOLINE		0x8000
+%define REL(x)			(TRAMPOLINE + (x) - trampoline_start)
+
+[GLOBAL trampoline_start]
+[GLOBAL trampoline_params]
+[GLOBAL trampoline_end]
+
+[BITS 16]
+trampoline_start:
+	cli
+	cld
+	mov ax, cs				; cs = 0x0800: смещения считаются от начала копии
+	mov ds, ax
+	lgdt [tr_gdt_ptr - trampoline_start]
+
+	mov eax, cr0
+	or al, 0x1				; PE: защищенный режим
+	mov cr0, eax
+	jmp dword 0x08:REL(tr_protected)
+
+[BITS 32]
+tr_protected:
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+	mov ss, ax
+
+	; Те же возможности страничной адресации, что у BSP, и каталог
+	; ядра. Страница трамплина в нем временно отображена сама на себя
+	mov eax, [REL(tr_cr4)]
+	mov cr4, eax
+	mov eax, [REL(tr_cr3)]
+	mov cr3, eax
+	mov eax, cr0
+	or eax, 0x80000000
+	mov cr0, eax
+
+	mov esp, [REL(tr_esp)]
+	jmp [REL(tr_entry)]		; в верхнюю половину, дальше - код на C
+
+; Плоские сегменты кода и данных, пока AP не загрузит свою GDT
+tr_gdt:
+	dq 0
+	dq 0x00CF9A000000FFFF
+	dq 0x00CF92000000FFFF
+tr_gdt_ptr:
+	dw tr_gdt_ptr - tr_gdt - 1
+	dd REL(tr_gdt)
+
+; Заполняет smp.c перед запуском каждого AP
+trampoline_params:
+tr_cr3:		dd 0
+tr_cr4:		dd 0
+tr_esp:		dd 0
+tr_entry:	dd 0
+trampoline_end:
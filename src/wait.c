@@ -0,0 +1,146 @@
+// wait.c -- Wait queues: blocking a task until an event
+
+#include "wait.h"
+#include "timer.h"
+
+// Снимает задачу из очереди. Под wq->lock
+static int wq_remove(wait_queue_t *wq, task_t *task)
+{
+	task_t **p, *prev = 0;
+
+	for (p = &wq->head; *p; prev = *p, p = &(*p)->wait_next)
+	{
+		if (*p == task)
+		{
+			*p = task->wait_next;
+			if (wq->tail == task)
+				wq->tail = prev;
+			task->wait_next = 0;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Снимает первую задачу очереди. Под wq->lock
+static task_t *wq_pop(wait_queue_t *wq)
+{
+	task_t *task = wq->head;
+
+	if (task)
+	{
+		wq->head = task->wait_next;
+		if (!wq->head)
+			wq->tail = 0;
+		task->wait_next = 0;
+	}
+	return task;
+}
+
+u32int prepare_to_wait(wait_queue_t *wq)
+{
+	u32int flags = spin_lock_irqsave(&wq->lock);
+	task_t *task = current_task;
+
+	task->wait_next = 0;
+	if (wq->tail)
+		wq->tail->wait_next = task;
+	else
+		wq->head = task;
+	wq->tail = task;
+	task->state = TASK_BLOCKED;
+	spin_release(&wq->lock);
+	return flags;
+}
+
+void finish_wait(wait_queue_t *wq, u32int flags)
+{
+	task_t *task = current_task;
+	int woken = 0;
+
+	spin_acquire(&wq->lock);
+	if (task->state != TASK_RUNNING)
+	{
+		// Условие выполнилось раньше, чем нас разбудили
+		if (wq_remove(wq, task))
+			task->state = TASK_RUNNING;
+		else
+			woken = 1;
+	}
+	spin_release(&wq->lock);
+
+	// Нас уже сняли из очереди, и task_wake() ждет, пока мы уйдем
+	// с процессора. Уходим: вернемся, когда он поставит нас в очередь.
+	// До этого задача не может завершиться, и будящий не обратится
+	// к освобожденной памяти
+	if (woken)
+		schedule();
+	irq_restore(flags);
+}
+
+void sleep_on(wait_queue_t *wq)
+{
+	u32int flags = prepare_to_wait(wq);
+	schedule();
+	finish_wait(wq, flags);
+}
+
+int wake_up(wait_queue_t *wq)
+{
+	u32int flags;
+	task_t *task;
+	int woken = 0;
+
+	// Переключение на разбуженную задачу - в preempt_enable()
+	preempt_disable();
+	flags = spin_lock_irqsave(&wq->lock);
+	task = wq_pop(wq);
+	spin_unlock_irqrestore(&wq->lock, flags);
+	if (task)
+		woken = task_wake(task);
+	preempt_enable();
+	return woken;
+}
+
+u32int wake_up_all(wait_queue_t *wq)
+{
+	u32int flags, n = 0;
+	task_t *list, *task;
+
+	preempt_disable();
+	flags = spin_lock_irqsave(&wq->lock);
+	list = wq->head;
+	wq->head = wq->tail = 0;
+	spin_unlock_irqrestore(&wq->lock, flags);
+	while ((task = list))
+	{
+		// wait_next читаем до пробуждения: потом задача может
+		// снова встать в очередь
+		list = task->wait_next;
+		task->wait_next = 0;
+		n += task_wake(task);
+	}
+	preempt_enable();
+	return n;
+}
+
+static void sleep_timeout(void *arg)
+{
+	task_wake((task_t*)arg);
+}
+
+void sleep_ticks(u32int ticks)
+{
+	task_t *task = current_task;
+	ktimer_t timer;
+	u32int flags;
+
+	// Таймер на стеке: колесо не трогает его после вызова
+	// sleep_timeout(), а до этого мы не проснемся
+	timer_setup(&timer, &sleep_timeout, task);
+	flags = irq_save();
+	task->state = TASK_BLOCKED;
+	timer_add(&timer, ticks);
+	schedule();
+	irq_restore(flags);
+}
@@ -0,0 +1,82 @@
+// wait.h -- Wait queues: blocking a task until an event
+
+#ifndef WAIT_H_
+#define WAIT_H_
+
+#include "common.h"
+#include "spinlock.h"
+#include "task.h"
+
+/**
+ * Очередь задач, ждущих события. Задачи будятся в порядке, в котором
+ * заснули. Будить можно из прерывания
+ */
+typedef struct wait_queue
+{
+	spinlock_t lock;
+	task_t *head;
+	task_t *tail;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT(name)	{ SPINLOCK_INIT(name), 0, 0 }
+
+// Есть ли в очереди ждущие задачи
+static inline int waitqueue_active(wait_queue_t *wq)
+{
+	return wq->head != 0;
+}
+
+/**
+ * Ставит текущую задачу в очередь и помечает заблокированной. Прерывания
+ * остаются выключенными до finish_wait(): между проверкой условия
+ * и schedule() пробуждение не потеряется. Возвращает прежние флаги
+ */
+extern u32int prepare_to_wait(wait_queue_t *wq);
+
+/**
+ * Завершает ожидание после prepare_to_wait(): убирает задачу из очереди,
+ * если ее не разбудили, и восстанавливает флаги
+ */
+extern void finish_wait(wait_queue_t *wq, u32int flags);
+
+/**
+ * Засыпает до ближайшего wake_up() на очереди. Условие, которого ждут,
+ * проверяется до вызова - пробуждение между ними будет потеряно, поэтому
+ * обычно нужен wait_event()
+ */
+extern void sleep_on(wait_queue_t *wq);
+
+/**
+ * Ждет, пока условие cond не станет истинным. Тот, кто делает его
+ * истинным, затем вызывает wake_up() или wake_up_all()
+ */
+#define wait_event(wq, cond)					\
+	do										\
+	{										\
+		u32int __flags;						\
+		while (!(cond))						\
+		{									\
+			__flags = prepare_to_wait(wq);	\
+			if (!(cond))					\
+				schedule();					\
+			finish_wait(wq, __flags);		\
+		}									\
+	} while (0)
+
+/**
+ * Будит первую задачу очереди. Возвращает 1, если разбудил.
+ * Если разбуженная задача важнее текущей, переключается на нее сразу
+ */
+extern int wake_up(wait_queue_t *wq);
+
+/**
+ * Будит все задачи очереди и возвращает их число
+ */
+extern u32int wake_up_all(wait_queue_t *wq);
+
+/**
+ * Блокирует текущую задачу на ticks тиков таймера (timer.c)
+ */
+extern void sleep_ticks(u32int ticks);
+
+#endif
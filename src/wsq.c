@@ -0,0 +1,49 @@
+// wsq.c -- Lock-free work-stealing deque (Chase-Lev) with
+//          a fixed-size ring
+//
+// Indices only grow and wrap around at 2^32; slots are taken modulo
+// the ring size. A slot can be reused by wsq_push() only after top
+// has moved past it, so a thief that read a stale item always loses
+// its cmpxchg on top and drops it. The kernel runs on x86, where
+// stores are not reordered with other stores and loads with other
+// loads, so compiler barriers are enough between the plain accesses.
+
+#include "wsq.h"
+#include "kheap.h"
+
+void wsq_init(wsq_t *q, u32int size)
+{
+	q->top = 0;
+	q->bottom = 0;
+	q->mask = size - 1;
+	q->buf = (void**)kmalloc(size * sizeof(void*));
+}
+
+int wsq_push(wsq_t *q, void *item)
+{
+	u32int b = q->bottom;
+
+	// top мог уже сдвинуться: кольцо в худшем случае покажется полным
+	if (b - q->top > q->mask)
+		return 0;
+	q->buf[b & q->mask] = item;
+	// Элемент должен оказаться в кольце раньше, чем его увидят
+	__asm__ volatile ("" : : : "memory");
+	q->bottom = b + 1;
+	return 1;
+}
+
+void *wsq_steal(wsq_t *q)
+{
+	u32int t = q->top, b;
+	void *item;
+
+	__asm__ volatile ("" : : : "memory");
+	b = q->bottom;
+	if ((s32int)(b - t) <= 0)
+		return 0;
+	item = q->buf[t & q->mask];
+	if (!__sync_bool_compare_and_swap(&q->top, t, t + 1))
+		return 0;
+	return item;
+}
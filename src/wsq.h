@@ -0,0 +1,46 @@
+// wsq.h -- Lock-free work-stealing deque (Chase-Lev) with
+//          a fixed-size ring
+
+#ifndef WSQ_H_
+#define WSQ_H_
+
+#include "common.h"
+
+/**
+ * Кладет элементы только владелец, на нижний конец (bottom).
+ * Забирают с верхнего конца (top) все процессоры, включая
+ * владельца, через cmpxchg: порядок выдачи - FIFO
+ */
+typedef struct wsq
+{
+	volatile u32int top;		// Следующий элемент на выдачу
+	volatile u32int bottom;		// Следующий свободный слот
+	u32int mask;				// Размер кольца - 1
+	void **buf;
+} wsq_t;
+
+/**
+ * Выделяет кольцо на size элементов, size - степень двойки
+ */
+extern void wsq_init(wsq_t *q, u32int size);
+
+/**
+ * Кладет item на нижний конец. Вызывает только владелец.
+ * Возвращает 0, если кольцо заполнено
+ */
+extern int wsq_push(wsq_t *q, void *item);
+
+/**
+ * Забирает элемент с верхнего конца. Возвращает 0, если дек
+ * пуст или другой процессор успел забрать этот элемент раньше
+ */
+extern void *wsq_steal(wsq_t *q);
+
+// Примерное число элементов: без синхронизации с другими процессорами
+static inline u32int wsq_size(wsq_t *q)
+{
+	s32int n = (s32int)(q->bottom - q->top);
+	return n > 0 ? n : 0;
+}
+
+#endif